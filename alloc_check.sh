@@ -0,0 +1,35 @@
+#!/bin/sh
+# Checks that the Asio relay loop of socks_server allocates nothing per chunk. Run by
+# "make alloc_check", which builds socks_server_alloc (operator new counted) and
+# relay_bench: pushes data through a few tunnels, then reads the counts that every
+# session printed when its relay ended.
+TUNNELS=${1:-8}
+KIB=${2:-8192}
+SOCKS_PORT=${SOCKS_PORT:-17090}
+ECHO_PORT=${ECHO_PORT:-17091}
+HERE=$(cd "$(dirname "$0")" && pwd)
+DIR=$(mktemp -d)
+trap 'kill $ECHO $SOCKS 2>/dev/null; rm -rf "$DIR"' EXIT
+
+printf 'permit c *.*.*.*\nrelay asio\n' >"$DIR/socks.conf"
+"$HERE/relay_bench" echo "$ECHO_PORT" &
+ECHO=$!
+(cd "$DIR" && exec "$HERE/socks_server_alloc" "$SOCKS_PORT" >/dev/null 2>"$DIR/counts") &
+SOCKS=$!
+sleep 0.5
+
+"$HERE/relay_bench" run "$SOCKS_PORT" "$ECHO_PORT" "$TUNNELS" "$KIB"
+while pgrep -P $SOCKS >/dev/null; do
+  sleep 0.2
+done
+
+awk -v tunnels="$TUNNELS" '
+  /^relay: / { sessions++; chunks += $2; allocations += $4 }
+  END {
+    printf "%d sessions, %d chunks, %d allocations\n", sessions, chunks, allocations
+    if (sessions != tunnels || chunks == 0 || allocations != 0) {
+      print "FAIL"
+      exit 1
+    }
+    print "OK"
+  }' "$DIR/counts"
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Throughput of the command/ utilities, run from this directory after make
+# (or with "make bench"):
+#   ./bench.sh [MB of input]
+# Each utility reads a generated HTML file once as its file argument and once
+# from a pipe, with its output going to /dev/null. delayedremovetag sleeps a
+# second per line and noop reads nothing, so they are left out.
+BIN=../bin
+MB=${1:-100}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+INPUT=$DIR/input.html
+LINES=$((MB * 1024 * 1024 / 64))
+awk -v n="$LINES" 'BEGIN {
+  for (i = 0; i < n; i++)
+    printf "<tr><td class=\"c%07d\">lorem <b>ipsum</b> dolor sit amet</td></tr>\n", i
+}' >"$INPUT"
+BYTES=$(wc -c <"$INPUT")
+
+now() { date +%s.%N; }
+
+# run <name> <command...>
+run() {
+  name=$1
+  shift
+  start=$(now)
+  "$@" >/dev/null 2>&1
+  end=$(now)
+  awk -v name="$name" -v s="$start" -v e="$end" -v b="$BYTES" -v l="$LINES" 'BEGIN {
+    t = e - s
+    printf "%-18s %8.3f s %9.1f MB/s %12.0f lines/s\n", name, t, b / t / 1048576, l / t
+  }'
+}
+
+echo "$BYTES bytes, $LINES lines"
+run "number" "$BIN/number" "$INPUT"
+run "number (pipe)" sh -c "cat '$INPUT' | '$BIN/number'"
+run "removetag" "$BIN/removetag" "$INPUT"
+run "removetag (pipe)" sh -c "cat '$INPUT' | '$BIN/removetag'"
+run "removetag0" "$BIN/removetag0" "$INPUT"
+run "removetag0 (pipe)" sh -c "cat '$INPUT' | '$BIN/removetag0'"
@@ -1,45 +1,31 @@
+#include <string.h>
 #include <unistd.h>
-#include <fstream>
-#include <iostream>
-using namespace std;
+#include "streamio.h"
+#include "tagscan.h"
 
 const size_t DELAYED_SECONDS = 1;
 
 int main(int argc, char* const argv[]) {
-  ifstream fin;
-  if (argc == 2) {
-    fin.open(argv[1]);
-    if (fin)
-      cin.rdbuf(fin.rdbuf());
-    else {
-      cerr << "Unable to open file \"" << argv[1] << "\"" << endl;
-      exit(EXIT_FAILURE);
-    }
-  } else if (argc > 2) {
-    cerr << "Usage: " << argv[0] << ' ' << "[file]" << endl;
-    exit(EXIT_FAILURE);
-  }
+  InputSource in;
+  openInputArg(in, argc, argv);
 
+  OutputSink out(STDOUT_FILENO);
   bool in_tag = false;
-  char c;
-  while (cin.get(c)) {
-    switch (c) {
-      case '<':
-        in_tag = true;
-        break;
-      case '>':
-        in_tag = false;
-        break;
-      default:
-        if (!in_tag) {
-          cout.put(c);
-          if (c == '\n') {
-            cout.flush();
-            sleep(DELAYED_SECONDS);
-          }
-        }
-        break;
-    }
+  const char* data;
+  size_t len;
+  while (in.next(data, len)) {
+    stripTags(data, data + len, in_tag, [&](const char* text, size_t n) {
+      const char* end = text + n;
+      const char* nl;
+      // Still one line per second: flush and sleep after every newline
+      while ((nl = static_cast<const char*>(memchr(text, '\n', end - text)))) {
+        out.write(text, nl - text + 1);
+        out.flush();
+        sleep(DELAYED_SECONDS);
+        text = nl + 1;
+      }
+      out.write(text, end - text);
+    });
   }
   return 0;
 }
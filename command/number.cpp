@@ -1,27 +1,59 @@
-#include <fstream>
-#include <iomanip>
-#include <iostream>
-using namespace std;
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "streamio.h"
+
+const size_t NUMBER_WIDTH = 4;
+
+// Same output as cout << setw(4) << setfill(' ') << line_count << ' '
+void putLineNumber(OutputSink& out, unsigned line_count) {
+  char digits[16];
+  char* p = digits + sizeof(digits);
+  *--p = ' ';
+  do {
+    *--p = '0' + line_count % 10;
+    line_count /= 10;
+  } while (line_count);
+  while (digits + sizeof(digits) - p < (ptrdiff_t)NUMBER_WIDTH + 1) *--p = ' ';
+  out.write(p, digits + sizeof(digits) - p);
+}
 
 int main(int argc, char* const argv[]) {
-  ifstream fin;
-  if (argc == 2) {
-    fin.open(argv[1]);
-    if (fin)
-      cin.rdbuf(fin.rdbuf());
-    else {
-      cerr << "Unable to open file \"" << argv[1] << "\"" << endl;
-      exit(EXIT_FAILURE);
-    }
-  } else if (argc > 2) {
-    cerr << "Usage: " << argv[0] << ' ' << "[file]" << endl;
-    exit(EXIT_FAILURE);
+  // -u: flush after every line, for interactive use
+  std::vector<char*> args(argv, argv + argc);
+  bool line_buffered = false;
+  if (args.size() >= 2 && strcmp(args[1], "-u") == 0) {
+    line_buffered = true;
+    args.erase(args.begin() + 1);
   }
 
-  string line;
+  InputSource in;
+  openInputArg(in, args.size(), args.data(), "[-u] [file]");
+
+  OutputSink out(STDOUT_FILENO);
   unsigned line_count = 0;
+  bool at_line_start = true;
+  const char* data;
+  size_t len;
 
-  while (getline(cin, line))
-    cout << setw(4) << setfill(' ') << ++line_count << ' ' << line << endl;
+  while (in.next(data, len)) {
+    const char* p = data;
+    const char* end = data + len;
+    while (p < end) {
+      if (at_line_start) putLineNumber(out, ++line_count);
+      const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+      if (!nl) {
+        out.write(p, end - p);
+        at_line_start = false;
+        break;
+      }
+      out.write(p, nl - p + 1);
+      at_line_start = true;
+      if (line_buffered) out.flush();
+      p = nl + 1;
+    }
+  }
+  // Like getline, a last line without '\n' is still terminated
+  if (!at_line_start) out.write("\n", 1);
   return 0;
 }
@@ -1,36 +1,17 @@
-#include <fstream>
-#include <iostream>
-using namespace std;
+#include <unistd.h>
+#include "streamio.h"
+#include "tagscan.h"
 
 int main(int argc, char* const argv[]) {
-  ifstream fin;
-  if (argc == 2) {
-    fin.open(argv[1]);
-    if (fin)
-      cin.rdbuf(fin.rdbuf());
-    else {
-      cerr << "Unable to open file \"" << argv[1] << "\"" << endl;
-      exit(EXIT_FAILURE);
-    }
-  } else if (argc > 2) {
-    cerr << "Usage: " << argv[0] << ' ' << "[file]" << endl;
-    exit(EXIT_FAILURE);
-  }
+  InputSource in;
+  openInputArg(in, argc, argv);
 
+  OutputSink out(STDOUT_FILENO);
   bool in_tag = false;
-  char c;
-  while (cin.get(c)) {
-    switch (c) {
-      case '<':
-        in_tag = true;
-        break;
-      case '>':
-        in_tag = false;
-        break;
-      default:
-        if (!in_tag) cout.put(c);
-        break;
-    }
-  }
+  const char* data;
+  size_t len;
+  while (in.next(data, len))
+    stripTags(data, data + len, in_tag,
+              [&](const char* text, size_t n) { out.write(text, n); });
   return 0;
 }
@@ -1,57 +1,48 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <memory.h>
-#include <string.h>
 #include <ctype.h>
+#include <string>
+#include "streamio.h"
+#include "tagscan.h"
 
 int main(int argc,char **argv){
-	FILE *fp;
-	char c;
-	int inTag=0;
+	InputSource in;
+	bool inTag = false;
 	bool errTag = false;
-	char TagMsg[1024];
-	int  iCount = 0;
+	std::string TagMsg;
+	const char *data;
+	size_t len;
 
-	if(argc == 1)
-		fp = stdin;
-	else if (argc == 2)
-		fp = fopen(argv[1],"r");
-	else{ 
+	if(argc > 2){ 
 		fprintf(stderr,"Usage:%s <file>\n",argv[1]);
 		exit(1);
 	}
-	while((c = fgetc(fp))!=EOF)
+	if(!in.open(argc == 2 ? argv[1] : NULL)){
+		fprintf(stderr,"Unable to open file \"%s\"\n",argv[1]);
+		exit(1);
+	}
+	while(in.next(data,len))
 	{
-		if(c == '<'){
-			inTag = 1;
-			continue;
-		}
-		if(c == '>'){
-			inTag = 0;
-			continue;
-
-		}
-		if(inTag)
-		{
-			TagMsg[iCount++] = c;
-			if(!isalpha(c) && c!='/')
-				errTag = true;
-		}
-
-		if(!inTag)
-		{
-			if(errTag)
-			{
-				TagMsg[iCount] = '\0';
-				fprintf (stderr, "Error: illegal tag \"%s\"\n",TagMsg);
-				errTag = false ;
-			}
-			iCount = 0;
-			memset( TagMsg, '\0', strlen(TagMsg));
-			fputc(c, stdout);
-		}
+		scanTags(data, data + len, inTag,
+			[&](const char *text, size_t n){
+				// The tag text is kept until the next character outside a tag
+				if(errTag)
+				{
+					fprintf (stderr, "Error: illegal tag \"%s\"\n",TagMsg.c_str());
+					errTag = false ;
+				}
+				TagMsg.clear();
+				// stdio buffering as before, so stdout and the error messages on
+				// stderr interleave the same way when they share a file
+				fwrite(text, 1, n, stdout);
+			},
+			[&](const char *tag, size_t n){
+				for(size_t i = 0; i < n; i++)
+					if(!isalpha((unsigned char)tag[i]) && tag[i]!='/')
+						errTag = true;
+				TagMsg.append(tag, n);
+			});
 	}  
 	fflush(stdout);
-	fclose(fp);
 	return(0);
-}          
+}
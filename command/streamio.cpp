@@ -0,0 +1,106 @@
+#include "streamio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <iostream>
+using namespace std;
+
+InputSource::InputSource()
+    : fd_(-1), map_(NULL), map_len_(0), map_done_(false), buf_(NULL) {}
+
+InputSource::~InputSource() {
+  if (map_) munmap(map_, map_len_);
+  delete[] buf_;
+  if (fd_ > STDERR_FILENO) close(fd_);
+}
+
+bool InputSource::open(const char* path) {
+  fd_ = path ? ::open(path, O_RDONLY) : STDIN_FILENO;
+  if (fd_ < 0) return false;
+
+  struct stat st;
+  if (fstat(fd_, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      map_ = static_cast<char*>(p);
+      map_len_ = st.st_size;
+      return true;
+    }
+  }
+  buf_ = new char[STREAMIO_BLOCK_SIZE];
+  return true;
+}
+
+bool InputSource::next(const char*& data, size_t& len) {
+  if (map_) {
+    if (map_done_) return false;
+    map_done_ = true;
+    data = map_;
+    len = map_len_;
+    return true;
+  }
+  ssize_t n;
+  do {
+    n = read(fd_, buf_, STREAMIO_BLOCK_SIZE);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) return false;
+  data = buf_;
+  len = n;
+  return true;
+}
+
+OutputSink::OutputSink(int fd)
+    : fd_(fd), buf_(new char[STREAMIO_BLOCK_SIZE]), len_(0) {}
+
+OutputSink::~OutputSink() {
+  flush();
+  delete[] buf_;
+}
+
+static void writeAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = ::write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      exit(EXIT_FAILURE);
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+void OutputSink::write(const char* data, size_t len) {
+  if (len_ + len > STREAMIO_BLOCK_SIZE) {
+    flush();
+    // Too big to be worth copying: write it straight through
+    if (len >= STREAMIO_BLOCK_SIZE) {
+      writeAll(fd_, data, len);
+      return;
+    }
+  }
+  memcpy(buf_ + len_, data, len);
+  len_ += len;
+}
+
+void OutputSink::flush() {
+  writeAll(fd_, buf_, len_);
+  len_ = 0;
+}
+
+void openInputArg(InputSource& in, int argc, char* const argv[],
+                  const char* usage) {
+  if (argc > 2) {
+    cerr << "Usage: " << argv[0] << ' ' << usage << endl;
+    exit(EXIT_FAILURE);
+  }
+  if (!in.open(argc == 2 ? argv[1] : NULL)) {
+    cerr << "Unable to open file \"" << argv[1] << "\"" << endl;
+    exit(EXIT_FAILURE);
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef STREAMIO_H
+#define STREAMIO_H
+
+#include <stddef.h>
+
+const size_t STREAMIO_BLOCK_SIZE = 1 << 16;
+
+// Input from a file or stdin. Regular files are mmap'ed and returned as a
+// single block; pipes and terminals are read in STREAMIO_BLOCK_SIZE blocks.
+class InputSource {
+ public:
+  InputSource();
+  ~InputSource();
+
+  // Opens path, or stdin when path is NULL. Returns false on failure.
+  bool open(const char* path);
+  // Points data at the next block of input. A block stays valid until the
+  // next call. Returns false at EOF or on a read error.
+  bool next(const char*& data, size_t& len);
+
+ private:
+  InputSource(const InputSource&);
+  InputSource& operator=(const InputSource&);
+
+  int fd_;
+  char* map_;
+  size_t map_len_;
+  bool map_done_;
+  char* buf_;
+};
+
+// Buffered output to a file descriptor, written only when the buffer is full,
+// on flush() or on destruction.
+class OutputSink {
+ public:
+  explicit OutputSink(int fd);
+  ~OutputSink();
+
+  void write(const char* data, size_t len);
+  void flush();
+
+ private:
+  OutputSink(const OutputSink&);
+  OutputSink& operator=(const OutputSink&);
+
+  int fd_;
+  char* buf_;
+  size_t len_;
+};
+
+// Shared "[file]" argument handling of the command/ utilities: opens argv[1]
+// or stdin, printing the usual messages and exiting on error.
+void openInputArg(InputSource& in, int argc, char* const argv[],
+                  const char* usage = "[file]");
+
+#endif
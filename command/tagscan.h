@@ -0,0 +1,82 @@
+#ifndef TAGSCAN_H
+#define TAGSCAN_H
+
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TAGSCAN_X86 1
+#endif
+
+// The 16-byte SSE2 search (a plain loop without SSE2), also used for the tail
+// of the AVX2 one.
+inline const char* findTagBoundarySse2(const char* p, const char* end) {
+#if defined(__SSE2__)
+  const __m128i lt16 = _mm_set1_epi8('<');
+  const __m128i gt16 = _mm_set1_epi8('>');
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, lt16), _mm_cmpeq_epi8(v, gt16)));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+#endif
+  for (; p < end; ++p)
+    if (*p == '<' || *p == '>') return p;
+  return end;
+}
+
+#if defined(TAGSCAN_X86)
+// Compiled for AVX2 whatever -m flags the build uses, and only called when the
+// CPU has it.
+__attribute__((target("avx2"))) inline const char* findTagBoundaryAvx2(
+    const char* p, const char* end) {
+  const __m256i lt32 = _mm256_set1_epi8('<');
+  const __m256i gt32 = _mm256_set1_epi8('>');
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    unsigned mask = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, lt32), _mm256_cmpeq_epi8(v, gt32)));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return findTagBoundarySse2(p, end);
+}
+#endif
+
+// Returns the first '<' or '>' in [p, end), or end if there is none.
+inline const char* findTagBoundary(const char* p, const char* end) {
+#if defined(TAGSCAN_X86)
+  static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+  if (hasAvx2) return findTagBoundaryAvx2(p, end);
+#endif
+  return findTagBoundarySse2(p, end);
+}
+
+// Splits [p, end) into runs of text and tag content, dropping the '<' and
+// '>' themselves. A '<' enters a tag and a '>' leaves it, wherever they
+// appear, which is exactly what the old one-char-at-a-time loops did.
+// in_tag carries the state across blocks.
+template <typename TextFn, typename TagFn>
+inline void scanTags(const char* p, const char* end, bool& in_tag,
+                     TextFn on_text, TagFn on_tag) {
+  while (p < end) {
+    const char* q = findTagBoundary(p, end);
+    if (q > p) {
+      if (in_tag)
+        on_tag(p, q - p);
+      else
+        on_text(p, q - p);
+    }
+    if (q == end) break;
+    in_tag = (*q == '<');
+    p = q + 1;
+  }
+}
+
+template <typename TextFn>
+inline void stripTags(const char* p, const char* end, bool& in_tag,
+                      TextFn on_text) {
+  scanTags(p, end, in_tag, on_text, [](const char*, size_t) {});
+}
+
+#endif
@@ -0,0 +1,692 @@
+// Console sessions shared by the hw4.cgi console and http_server's native console:
+// each Client runs one test case against a shell through the SOCKS server and
+// reports its output through a callback.
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <boost/algorithm/string.hpp> // Include the header file for boost::split
+#include <boost/asio.hpp>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+using boost::asio::ip::tcp;
+using namespace std;
+
+#define MAX_CONNECTION 5
+#define SOCKS_VERSION 4
+#define SOCKS_CONNECT 1
+#define SOCKS_GRANTED 90
+#define SOCKS_REJECTED 91
+#define REQUEST_HEADER_SIZE 9
+#define REPLY_PACKET_SIZE 8
+#define SOCKS_MUX 0x80 // Extension: one connection carries the CONNECT streams of many clients
+#define MUX_OPEN 1     // Frame types, see MuxChannel
+#define MUX_REPLY 2
+#define MUX_DATA 3
+#define MUX_CLOSE 4
+#define MUX_HEADER_SIZE 4
+#define MUX_USE_SOCKS4 1 // MUX_REPLY code: open this stream as a plain SOCKS4 connection instead
+
+const string contentHead = R"(
+<!DOCTYPE html>
+<html lang="en">
+  <head>
+    <meta charset="UTF-8" />
+    <title>NP Project 3 Console</title>
+    <link
+      rel="stylesheet"
+      href="https://cdn.jsdelivr.net/npm/bootstrap@4.5.3/dist/css/bootstrap.min.css"
+      integrity="sha384-TX8t27EcRE3e/ihU7zmQxVncDAy5uIKz4rEkgIXeMed4M0jlfIDPvg6uqKI2xXr2"
+      crossorigin="anonymous"
+    />
+    <link
+      href="https://fonts.googleapis.com/css?family=Source+Code+Pro"
+      rel="stylesheet"
+    />
+    <link
+      rel="icon"
+      type="image/png"
+      href="https://cdn0.iconfinder.com/data/icons/small-n-flat/24/678068-terminal-512.png"
+    />
+    <style>
+      * {
+        font-family: 'Source Code Pro', monospace;
+        font-size: 1rem !important;
+      }
+      body {
+        background-color: #232731;
+      }
+      pre {
+        color: #D8DEE9;
+      }
+      b {
+        color: #a3be8c;
+      }
+      th {
+        color: #81A1C1;
+      }
+    </style>
+  </head>
+)";
+const string contentBodyFront = R"(
+  <body>
+    <table class="table table-dark table-bordered">
+      <thead>
+        <tr>
+)";
+const string contentBodyMiddle = R"(
+        </tr>
+      </thead>
+      <tbody>
+        <tr>
+)";
+const string contentBodyEnd = R"(
+        <tr>
+      </tbody>
+    </table>
+  </body>
+</html>
+)";
+
+struct ConnectionInfo {
+    string host = "";
+    string port = "";
+    string file = "";
+};
+
+struct SocketsServerInfo {
+    string host = "";
+    string port = "";
+};
+
+// Port number of a query string value, 0 unless it is 1 to 65535
+inline int parsePort(const string &port) {
+    if (port.empty() || port.size() > 5 || port.find_first_not_of("0123456789") != string::npos) {
+        return 0;
+    }
+    int number = stoi(port);
+    return number <= 65535 ? number : 0;
+}
+
+// Called with the session index, its new output and whether it is a command sent
+// to the shell; returning false closes the session
+typedef std::function<bool(int, const string &, bool)> OutputHandler;
+// Called once a session has finished
+typedef std::function<void()> DoneHandler;
+
+// One connection to the SOCKS server carrying the streams of every Client of a console,
+// so the console makes one connection and one SOCKS handshake instead of one per session.
+// After a SOCKS4 request with CD = SOCKS_MUX is granted, both sides exchange frames of
+//   TYPE(1) STREAM(1) LENGTH(2) PAYLOAD
+// MUX_OPEN carries DSTPORT(2) DSTIP(4) DOMAIN_NAME and is answered by a one byte MUX_REPLY,
+// then MUX_DATA frames flow both ways until either side sends MUX_CLOSE. A SOCKS server
+// without the extension rejects the request and the clients fall back to SOCKS4.
+class MuxChannel : public std::enable_shared_from_this<MuxChannel> {
+  public:
+    typedef std::function<void(int)> OpenHandler; // Called with the MUX_REPLY code
+    typedef std::function<void(boost::system::error_code, const string &)> ReadHandler;
+    typedef std::function<void(boost::system::error_code)> WriteHandler;
+
+    MuxChannel(boost::asio::io_context &io_context) : socket_(io_context) {}
+
+    // Calls ready with whether the SOCKS server accepted the channel
+    void start(tcp::resolver::results_type endpoints, std::function<void(bool)> ready) {
+        auto self(shared_from_this());
+        socket_.async_connect(
+            *endpoints,
+            [this, self, ready](boost::system::error_code ec) {
+                if (ec) {
+                    ready(false);
+                    return;
+                }
+                request_ = {SOCKS_VERSION, SOCKS_MUX, 0, 0, 0, 0, 0, 0, 0};
+                boost::asio::async_write(
+                    socket_,
+                    boost::asio::buffer(request_),
+                    [this, self, ready](boost::system::error_code ec, std::size_t) {
+                        if (ec) {
+                            ready(false);
+                            return;
+                        }
+                        boost::asio::async_read(
+                            socket_,
+                            boost::asio::buffer(reply_, REPLY_PACKET_SIZE),
+                            [this, self, ready](boost::system::error_code ec, std::size_t) {
+                                if (ec || reply_[1] != SOCKS_GRANTED) {
+                                    socket_.close(ec);
+                                    ready(false);
+                                    return;
+                                }
+                                ready(true);
+                                doReadHeader();
+                            });
+                    });
+            });
+    }
+
+    void open(int id, const string &host, int port, OpenHandler handler) {
+        streams_[id].onOpen = std::move(handler);
+        string payload;
+        payload += (char)(port / 256); // DSTPORT
+        payload += (char)(port % 256); // DSTPORT
+        payload += string("\0\0\0\1", 4); // DSTIP 0.0.0.1, the server resolves DOMAIN_NAME
+        payload += host;
+        sendFrame(MUX_OPEN, id, payload);
+    }
+
+    // Hands the next data of the stream to handler, an error once the stream has ended
+    void read(int id, ReadHandler handler) {
+        auto it = streams_.find(id);
+        if (it == streams_.end()) {
+            boost::asio::post(socket_.get_executor(), [handler]() { handler(boost::asio::error::eof, ""); });
+            return;
+        }
+        Stream &stream = it->second;
+        if (!stream.pending.empty()) {
+            string data = std::move(stream.pending.front());
+            stream.pending.pop_front();
+            boost::asio::post(socket_.get_executor(), [handler, data]() { handler(boost::system::error_code(), data); });
+        }
+        else if (stream.ended) {
+            streams_.erase(it);
+            boost::asio::post(socket_.get_executor(), [handler]() { handler(boost::asio::error::eof, ""); });
+            shutdownIfIdle();
+        }
+        else {
+            stream.onRead = std::move(handler);
+        }
+    }
+
+    void write(int id, const string &data, WriteHandler handler) {
+        sendFrame(MUX_DATA, id, data, std::move(handler));
+    }
+
+    void close(int id) {
+        auto it = streams_.find(id);
+        if (it == streams_.end()) {
+            return;
+        }
+        if (!it->second.ended) {
+            sendFrame(MUX_CLOSE, id, "");
+        }
+        endStream(it, boost::asio::error::operation_aborted);
+        shutdownIfIdle();
+    }
+
+  private:
+    struct Stream {
+        OpenHandler onOpen;
+        ReadHandler onRead;
+        deque<string> pending; // Data that arrived before the client asked for it
+        bool ended = false;    // The server closed the stream
+    };
+
+    struct Frame {
+        string bytes;
+        WriteHandler done;
+    };
+
+    void sendFrame(int type, int id, const string &payload, WriteHandler done = nullptr) {
+        Frame frame;
+        frame.bytes += (char)type;
+        frame.bytes += (char)id;
+        frame.bytes += (char)(payload.size() / 256);
+        frame.bytes += (char)(payload.size() % 256);
+        frame.bytes += payload;
+        frame.done = std::move(done);
+        writeQueue_.push_back(std::move(frame));
+        if (writeQueue_.size() == 1) {
+            doWrite();
+        }
+    }
+
+    void doWrite() {
+        auto self(shared_from_this());
+        boost::asio::async_write(
+            socket_,
+            boost::asio::buffer(writeQueue_.front().bytes),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                WriteHandler done = std::move(writeQueue_.front().done);
+                writeQueue_.pop_front();
+                if (ec) {
+                    writeQueue_.clear();
+                    fail();
+                }
+                else if (!writeQueue_.empty()) {
+                    doWrite();
+                }
+                if (done) {
+                    done(ec);
+                }
+                shutdownIfIdle();
+            });
+    }
+
+    void doReadHeader() {
+        auto self(shared_from_this());
+        boost::asio::async_read(
+            socket_,
+            boost::asio::buffer(header_, MUX_HEADER_SIZE),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    fail();
+                    return;
+                }
+                payload_.resize(header_[2] * 256 + header_[3]);
+                boost::asio::async_read(
+                    socket_,
+                    boost::asio::buffer(&payload_[0], payload_.size()),
+                    [this, self](boost::system::error_code ec, std::size_t) {
+                        if (ec) {
+                            fail();
+                            return;
+                        }
+                        handleFrame();
+                        doReadHeader();
+                    });
+            });
+    }
+
+    void handleFrame() {
+        auto it = streams_.find(header_[1]);
+        if (it == streams_.end()) {
+            return; // Already closed on this side
+        }
+        Stream &stream = it->second;
+        if (header_[0] == MUX_REPLY && stream.onOpen) {
+            OpenHandler handler = std::move(stream.onOpen);
+            int reply = payload_.empty() ? SOCKS_REJECTED : (unsigned char)payload_[0];
+            if (reply != SOCKS_GRANTED) {
+                streams_.erase(it); // The server has already forgotten the stream
+            }
+            handler(reply);
+            shutdownIfIdle();
+        }
+        else if (header_[0] == MUX_DATA) {
+            if (stream.onRead) {
+                ReadHandler handler = std::move(stream.onRead);
+                stream.onRead = nullptr;
+                handler(boost::system::error_code(), payload_);
+            }
+            else {
+                stream.pending.push_back(payload_);
+            }
+        }
+        else if (header_[0] == MUX_CLOSE) {
+            stream.ended = true;
+            if (stream.onRead) {
+                endStream(it, boost::asio::error::eof);
+                shutdownIfIdle();
+            }
+        }
+    }
+
+    void endStream(map<int, Stream>::iterator it, boost::system::error_code ec) {
+        ReadHandler onRead = std::move(it->second.onRead);
+        OpenHandler onOpen = std::move(it->second.onOpen);
+        streams_.erase(it);
+        if (onRead) {
+            boost::asio::post(socket_.get_executor(), [onRead, ec]() { onRead(ec, ""); });
+        }
+        if (onOpen) {
+            onOpen(SOCKS_REJECTED);
+        }
+    }
+
+    // The channel lost its connection: end every stream
+    void fail() {
+        boost::system::error_code ec;
+        socket_.close(ec);
+        while (!streams_.empty()) {
+            endStream(streams_.begin(), boost::asio::error::connection_reset);
+        }
+    }
+
+    // Close the connection once every stream has ended and its last frame is out
+    void shutdownIfIdle() {
+        if (streams_.empty() && writeQueue_.empty()) {
+            boost::system::error_code ec;
+            socket_.close(ec);
+        }
+    }
+
+    tcp::socket socket_;
+    map<int, Stream> streams_;
+    deque<Frame> writeQueue_;
+    vector<unsigned char> request_;
+    unsigned char reply_[REPLY_PACKET_SIZE];
+    unsigned char header_[MUX_HEADER_SIZE];
+    string payload_;
+};
+
+class Client : public std::enable_shared_from_this<Client> {
+  public:
+    Client(int index, const ConnectionInfo &connection, boost::asio::io_context &io_context, OutputHandler output, DoneHandler done)
+        : userIdx_(index), connection_(connection), socket_(io_context), output_(std::move(output)), done_(std::move(done)) {}
+
+    ~Client() {
+        if (done_) {
+            done_();
+        }
+    }
+
+    // The SOCKS server is resolved once in makeConnection() and shared by all clients
+    void start(tcp::resolver::results_type endpoints) {
+        file_.open(("./test_case/" + connection_.file), ios::in); // Open file
+        doConnect(endpoints);
+    }
+
+    // Runs the session as a stream of a shared MuxChannel
+    void startMux(std::shared_ptr<MuxChannel> mux, tcp::resolver::results_type endpoints) {
+        auto self(shared_from_this());
+        file_.open(("./test_case/" + connection_.file), ios::in); // Open file
+        mux_ = std::move(mux);
+        mux_->open(userIdx_, connection_.host, parsePort(connection_.port), [this, self, endpoints](int reply) {
+            if (reply == SOCKS_GRANTED) {
+                doRead();
+            }
+            else if (reply == MUX_USE_SOCKS4) {
+                mux_.reset();
+                doConnect(endpoints);
+            }
+            else {
+                cerr << "Socks connection failed" << endl;
+            }
+        });
+    }
+
+  private:
+    void doConnect(tcp::resolver::results_type endpoints) {
+        auto self(shared_from_this());
+        socket_.async_connect(
+            *endpoints,
+            [this, self](boost::system::error_code ec) {
+                if (!ec) {
+                    sendSocksRequest();
+                }
+            });
+    }
+
+    // SOCKS4A request: VN CD DSTPORT(2) DSTIP(0.0.0.1) USERID(empty) NULL DOMAIN_NAME NULL
+    void sendSocksRequest() {
+        auto self(shared_from_this());
+        const string &host = connection_.host;
+        int port = parsePort(connection_.port);
+        request_.clear();
+        request_.reserve(REQUEST_HEADER_SIZE + host.length() + 1);
+        request_.push_back(SOCKS_VERSION); // VN
+        request_.push_back(SOCKS_CONNECT); // CD
+        request_.push_back(port / 256);    // DSTPORT
+        request_.push_back(port % 256);    // DSTPORT
+        request_.push_back(0);             // DSTIP
+        request_.push_back(0);             // DSTIP
+        request_.push_back(0);             // DSTIP
+        request_.push_back(1);             // DSTIP
+        request_.push_back(0);             // NULL
+        request_.insert(request_.end(), host.begin(), host.end()); // DOMAIN_NAME
+        request_.push_back(0);                                     // NULL
+        boost::asio::async_write(
+            socket_,
+            boost::asio::buffer(request_),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (!ec) {
+                    readSocksReply();
+                }
+            });
+    }
+
+    void readSocksReply() {
+        auto self(shared_from_this());
+        memset(reply_, 0, REPLY_PACKET_SIZE);
+        boost::asio::async_read(
+            socket_,
+            boost::asio::buffer(reply_, REPLY_PACKET_SIZE),
+            [this, self](boost::system::error_code ec, std::size_t length) {
+                if (!ec) {
+                    if (reply_[1] == SOCKS_GRANTED) {
+                        doRead();
+                    }
+                    else {
+                        cerr << "Socks connection failed" << endl;
+                        socket_.close();
+                    }
+                }
+            });
+    }
+
+    void doRead() {
+        auto self(shared_from_this());
+        if (mux_) {
+            mux_->read(userIdx_, [this, self](boost::system::error_code ec, const string &content) {
+                if (!ec) {
+                    handleOutput(content);
+                }
+            });
+            return;
+        }
+        socket_.async_read_some(
+            boost::asio::buffer(data_, max_length),
+            [this, self](boost::system::error_code ec, std::size_t length) {
+                if (!ec) {
+                    string content(data_, length);
+                    // Clear read data
+                    memset(data_, '\0', max_length);
+
+                    handleOutput(content);
+                }
+            });
+    }
+
+    void handleOutput(const string &content) {
+        outputShell(content);
+
+        if (content.find("% ") != string::npos) {
+            doWrite();
+        }
+        else {
+            doRead();
+        }
+    }
+
+    void doWrite() {
+        auto self(shared_from_this());
+        command_ = getCommand();
+        if (mux_) {
+            mux_->write(userIdx_, command_, [this, self](boost::system::error_code ec) {
+                if (!ec) {
+                    writeDone();
+                }
+            });
+            return;
+        }
+        boost::asio::async_write(
+            socket_,
+            boost::asio::buffer(command_.c_str(), command_.length()),
+            [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+                if (!ec) {
+                    writeDone();
+                }
+            });
+    }
+
+    void writeDone() {
+        if (!file_.is_open()) {
+            closeConnection();
+        }
+        doRead();
+    }
+
+    void closeConnection() {
+        if (mux_) {
+            mux_->close(userIdx_);
+        }
+        else {
+            socket_.close();
+        }
+    }
+
+    string getCommand() {
+        string command;
+        if (file_.is_open()) {
+            getline(file_, command);
+            if (command.find("exit") != string::npos) {
+                file_.close();
+            }
+            command += "\n";
+            outputCommand(command);
+        }
+        return command;
+    }
+
+    void outputShell(string content) {
+        if (!output_(userIdx_, content, false)) {
+            closeConnection(); // Nobody is watching anymore
+        }
+    }
+
+    void outputCommand(string content) {
+        if (!output_(userIdx_, content, true)) {
+            closeConnection();
+        }
+    }
+
+    int userIdx_;
+    ConnectionInfo connection_;
+    tcp::socket socket_;
+    std::shared_ptr<MuxChannel> mux_; // Set while the session runs over a MuxChannel
+    OutputHandler output_;
+    DoneHandler done_;
+    fstream file_;
+    enum { max_length = 1024 };
+    char data_[max_length];
+    string command_;
+    vector<unsigned char> request_;
+    unsigned char reply_[REPLY_PACKET_SIZE];
+};
+
+// Session index of a query key like "h0", "p0" or "f0", -1 if it names no session
+inline int connectionIndex(const string &key, int count) {
+    if (key.size() < 2 || key.size() > 3 || key.find_first_not_of("0123456789", 1) != string::npos) {
+        return -1;
+    }
+    int index = stoi(key.substr(1));
+    return index < count ? index : -1;
+}
+
+// A session needs a host, a valid port and a test case file in ./test_case
+inline bool validConnection(const ConnectionInfo &connection) {
+    const string &file = connection.file;
+    if (connection.host.empty() || parsePort(connection.port) == 0 ||
+        file.empty() || file == "." || file == ".." || file.find('/') != string::npos) {
+        return false;
+    }
+    return ifstream("./test_case/" + file).good();
+}
+
+// Sessions that fail validConnection() are dropped, the rest move up to keep their order
+inline void parseQueryString(const string &queryString, vector<ConnectionInfo> &connections, SocketsServerInfo &socketsServer) {
+    vector<string> tmp;
+    boost::split(tmp, queryString, boost::is_any_of("&"));
+    for (unsigned long int i = 0; i < tmp.size(); i++) {
+        vector<string> tmp2;
+        boost::split(tmp2, tmp[i], boost::is_any_of("="));
+        if (tmp2.size() == 2) {
+            int index = connectionIndex(tmp2[0], connections.size());
+            if (tmp2[0] == "sh") {
+                socketsServer.host = tmp2[1];
+            }
+            else if (tmp2[0] == "sp") {
+                socketsServer.port = tmp2[1];
+            }
+            else if (index < 0) {
+                continue;
+            }
+            else if (tmp2[0][0] == 'h') {
+                connections[index].host = tmp2[1];
+            }
+            else if (tmp2[0][0] == 'p') {
+                connections[index].port = tmp2[1];
+            }
+            else if (tmp2[0][0] == 'f') {
+                connections[index].file = tmp2[1];
+            }
+        }
+    }
+
+    vector<ConnectionInfo> valid;
+    for (const ConnectionInfo &connection : connections) {
+        if (validConnection(connection)) {
+            valid.push_back(connection);
+        }
+    }
+    valid.resize(connections.size());
+    connections = valid;
+}
+
+inline int countConnections(const vector<ConnectionInfo> &connections) {
+    int count = 0;
+    while (count < MAX_CONNECTION && connections[count].host != "") {
+        count++;
+    }
+    return count;
+}
+
+// The console table, one column per session, without the Content-Type header
+inline string consoleBody(const vector<ConnectionInfo> &connections) {
+    string body = contentHead + contentBodyFront;
+    for (int i = 0; i < countConnections(connections); i++) {
+        body += "<th scope=\"col\">" + connections[i].host + ":" + connections[i].port + "</th>";
+    }
+    body += contentBodyMiddle;
+    for (int i = 0; i < countConnections(connections); i++) {
+        body += "<td><pre id=\"s" + to_string(i) + "\" class=\"mb-0\"></pre></td>";
+    }
+    body += contentBodyEnd;
+    return body;
+}
+
+inline void makeConnection(boost::asio::io_context &io_context, tcp::resolver &resolver,
+                           const vector<ConnectionInfo> &connections, const SocketsServerInfo &socketsServer,
+                           OutputHandler output, DoneHandler done = nullptr) {
+    int count = countConnections(connections);
+    if (count == 0) {
+        return;
+    }
+
+    // All clients go through the same SOCKS server, so resolve it only once
+    resolver.async_resolve(
+        socketsServer.host,
+        socketsServer.port,
+        [&io_context, connections, count, output, done](boost::system::error_code ec, tcp::resolver::results_type endpoints) {
+            if (ec) {
+                cerr << "Resolve SOCKS server failed: " << ec.message() << endl;
+                for (int idx = 0; idx < count && done; idx++) {
+                    done();
+                }
+                return;
+            }
+            // Try one multiplexed connection first, plain SOCKS4 connections if the server lacks it
+            auto mux = std::make_shared<MuxChannel>(io_context);
+            mux->start(endpoints, [&io_context, connections, count, output, done, mux, endpoints](bool muxed) {
+                for (int idx = 0; idx < count; idx++) {
+                    auto client = std::make_shared<Client>(idx, connections[idx], io_context, output, done);
+                    if (muxed) {
+                        client->startMux(mux, endpoints);
+                    }
+                    else {
+                        client->start(endpoints);
+                    }
+                }
+            });
+        });
+}
+
+#endif
@@ -1,13 +1,27 @@
+#include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <sstream>
+#include <sys/inotify.h>
+#include <sys/wait.h>
 #include <utility>
 
+#include "console.h"
+
 using boost::asio::ip::tcp;
 using namespace std;
 
+#define MAX_QUEUED_EVENT_BYTES 65536 // Per viewer, a viewer that falls further behind is dropped
+#define MAX_CACHE_ENTRIES 256
+
 struct Environment {
     string REQUEST_METHOD = "";
     string REQUEST_URI = "";
@@ -23,9 +37,326 @@ struct Environment {
 
 const string HTTP_OK = "HTTP/1.1 200 OK\r\n";
 
+// Native console page: the table of console.h plus a script that follows /console/events
+const string consoleScript = R"(
+<script>
+  const events = new EventSource('/console/events' + location.search);
+  const append = (e, isCommand) => {
+    const message = JSON.parse(e.data);
+    const node = document.createElement(isCommand ? 'b' : 'span');
+    node.textContent = message.t;
+    document.getElementById('s' + message.s).appendChild(node);
+  };
+  events.addEventListener('output', e => append(e, false));
+  events.addEventListener('command', e => append(e, true));
+  // Closing also stops the browser from reconnecting, which would rerun the test cases
+  events.addEventListener('end', () => events.close());
+  events.onerror = () => events.close();
+</script>
+)";
+
+string jsonEscape(const string &content) {
+    string escaped;
+    escaped.reserve(content.size() + 16);
+    for (unsigned char c : content) {
+        switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\t': escaped += "\\t"; break;
+            case '\r': break; // Dropped, as in the CGI console
+            default:
+                if (c < 0x20) {
+                    char code[8];
+                    snprintf(code, sizeof(code), "\\u%04x", c);
+                    escaped += code;
+                }
+                else {
+                    escaped += c;
+                }
+        }
+    }
+    return escaped;
+}
+
+// Runs the console sessions of one viewer inside http_server and streams their
+// output as Server-Sent Events, instead of forking a CGI console per viewer
+class ConsoleStream : public std::enable_shared_from_this<ConsoleStream> {
+  public:
+    ConsoleStream(tcp::socket socket, boost::asio::io_context &io_context, const string &queryString)
+        : socket_(std::move(socket)), io_context_(io_context), resolver_(io_context),
+          connections_(MAX_CONNECTION), queryString_(queryString) {}
+
+    void start() {
+        parseQueryString(queryString_, connections_, socketsServer_);
+        remaining_ = countConnections(connections_);
+        queueEvent(HTTP_OK + "Content-Type: text/event-stream\r\nCache-Control: no-cache\r\n\r\n");
+        if (remaining_ == 0) {
+            endStream();
+            return;
+        }
+        auto self(shared_from_this());
+        makeConnection(
+            io_context_, resolver_, connections_, socketsServer_,
+            [self](int userIdx, const string &content, bool isCommand) {
+                return self->queueEvent(string("event: ") + (isCommand ? "command" : "output") +
+                                        "\ndata: {\"s\":" + to_string(userIdx) + ",\"t\":\"" + jsonEscape(content) + "\"}\n\n");
+            },
+            [self]() {
+                if (--self->remaining_ == 0) {
+                    self->endStream();
+                }
+            });
+    }
+
+  private:
+    void endStream() {
+        queueEvent("event: end\ndata:\n\n");
+        ending_ = true;
+        if (!writing_) {
+            close();
+        }
+    }
+
+    // Returns false once the viewer is gone, which stops the sessions
+    bool queueEvent(string event) {
+        if (closed_) {
+            return false;
+        }
+        if (queuedBytes_ + event.size() > MAX_QUEUED_EVENT_BYTES) {
+            close();
+            return false;
+        }
+        queuedBytes_ += event.size();
+        queue_.push_back(std::move(event));
+        if (!writing_) {
+            doWrite();
+        }
+        return true;
+    }
+
+    // Everything queued so far goes out in one write
+    void doWrite() {
+        auto self(shared_from_this());
+        writing_ = true;
+        writeBuffer_.clear();
+        for (const string &event : queue_) {
+            writeBuffer_ += event;
+        }
+        queue_.clear();
+        queuedBytes_ = 0;
+        boost::asio::async_write(
+            socket_,
+            boost::asio::buffer(writeBuffer_),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                writing_ = false;
+                if (ec) {
+                    close();
+                }
+                else if (!queue_.empty()) {
+                    doWrite();
+                }
+                else if (ending_) {
+                    close();
+                }
+            });
+    }
+
+    void close() {
+        boost::system::error_code ec;
+        closed_ = true;
+        queue_.clear();
+        socket_.close(ec);
+    }
+
+    tcp::socket socket_;
+    boost::asio::io_context &io_context_;
+    tcp::resolver resolver_;
+    vector<ConnectionInfo> connections_;
+    SocketsServerInfo socketsServer_;
+    string queryString_;
+    int remaining_ = 0;
+    deque<string> queue_;
+    size_t queuedBytes_ = 0;
+    string writeBuffer_;
+    bool writing_ = false;
+    bool ending_ = false;
+    bool closed_ = false;
+};
+
+// Opt-in cache of GET CGI responses, keyed by path and query string, configured in
+// cgi_cache.conf with lines like
+//   cache /panel_socks.cgi ttl=60 watch=test_case
+// An entry expires after ttl seconds (0: never) or as soon as anything changes in
+// one of the watched directories (inotify). Without the file nothing is cached.
+class CgiCache {
+  public:
+    CgiCache(boost::asio::io_context &io_context) : inotify_(io_context) {}
+
+    void load(const string &path) {
+        string line;
+        ifstream file(path);
+        while (getline(file, line)) {
+            vector<string> tokens;
+            boost::split(tokens, line, boost::is_any_of(" "), boost::token_compress_on);
+            if (tokens.size() < 2 || tokens[0] != "cache") {
+                continue;
+            }
+            Rule &rule = rules_[tokens[1]];
+            for (size_t i = 2; i < tokens.size(); i++) {
+                if (boost::starts_with(tokens[i], "ttl=")) {
+                    rule.ttl = atoi(tokens[i].substr(4).c_str());
+                }
+                else if (boost::starts_with(tokens[i], "watch=")) {
+                    int wd = addWatch(tokens[i].substr(6));
+                    if (wd >= 0) {
+                        rule.watches.push_back(wd);
+                    }
+                }
+            }
+        }
+        file.close();
+        if (inotify_.is_open()) {
+            doReadEvents();
+        }
+    }
+
+    bool isCacheable(const string &path) const {
+        return rules_.count(path) > 0;
+    }
+
+    const string *find(const string &key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            return nullptr;
+        }
+        if (it->second.expires <= std::chrono::steady_clock::now()) {
+            entries_.erase(it);
+            return nullptr;
+        }
+        return &it->second.output;
+    }
+
+    void store(const string &key, const string &path, const string &output) {
+        if (entries_.size() >= MAX_CACHE_ENTRIES) {
+            entries_.clear();
+        }
+        int ttl = rules_[path].ttl;
+        Entry &entry = entries_[key];
+        entry.path = path;
+        entry.output = output;
+        entry.expires = ttl > 0 ? std::chrono::steady_clock::now() + std::chrono::seconds(ttl)
+                                : std::chrono::steady_clock::time_point::max();
+    }
+
+  private:
+    struct Rule {
+        int ttl = 0;
+        vector<int> watches; // inotify watch descriptors
+    };
+
+    struct Entry {
+        string path;
+        string output;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    int addWatch(const string &directory) {
+        if (!inotify_.is_open()) {
+            int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd < 0) {
+                return -1;
+            }
+            inotify_.assign(fd);
+        }
+        return inotify_add_watch(inotify_.native_handle(), directory.c_str(),
+                                 IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB);
+    }
+
+    void doReadEvents() {
+        inotify_.async_read_some(
+            boost::asio::buffer(events_, sizeof(events_)),
+            [this](boost::system::error_code ec, std::size_t length) {
+                if (ec) {
+                    return;
+                }
+                for (size_t offset = 0; offset < length;) {
+                    const inotify_event *event = reinterpret_cast<const inotify_event *>(events_ + offset);
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        entries_.clear(); // Events were lost, any entry may be stale
+                    }
+                    else {
+                        invalidate(event->wd);
+                    }
+                    offset += sizeof(inotify_event) + event->len;
+                }
+                doReadEvents();
+            });
+    }
+
+    // Drops every entry of a path that watches wd
+    void invalidate(int wd) {
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            const vector<int> &watches = rules_[it->second.path].watches;
+            if (std::find(watches.begin(), watches.end(), wd) != watches.end()) {
+                it = entries_.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+
+    map<string, Rule> rules_;
+    map<string, Entry> entries_;
+    boost::asio::posix::stream_descriptor inotify_;
+    alignas(inotify_event) char events_[4096];
+};
+
+// Reaps every CGI process on SIGCHLD without blocking the event loop, and tells
+// whoever watches a pid how it exited
+class ChildReaper {
+  public:
+    typedef std::function<void(int)> ExitHandler; // Called with the waitpid() status
+
+    ChildReaper(boost::asio::io_context &io_context) : signals_(io_context, SIGCHLD) {
+        doWait();
+    }
+
+    // Must be called before returning to the event loop after the fork
+    void watch(pid_t pid, ExitHandler handler) {
+        handlers_[pid] = std::move(handler);
+    }
+
+  private:
+    void doWait() {
+        signals_.async_wait(
+            [this](boost::system::error_code ec, int /*signo*/) {
+                if (ec) {
+                    return;
+                }
+                pid_t pid;
+                int status;
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                    auto it = handlers_.find(pid);
+                    if (it != handlers_.end()) {
+                        ExitHandler handler = std::move(it->second);
+                        handlers_.erase(it);
+                        handler(status);
+                    }
+                }
+                doWait();
+            });
+    }
+
+    boost::asio::signal_set signals_;
+    map<pid_t, ExitHandler> handlers_;
+};
+
 class Session : public std::enable_shared_from_this<Session> {
   public:
-    Session(tcp::socket socket) : socket_(std::move(socket)) {}
+    Session(tcp::socket socket, boost::asio::io_context &io_context, CgiCache &cgiCache, ChildReaper &reaper)
+        : socket_(std::move(socket)), io_context_(io_context), cgiCache_(cgiCache), reaper_(reaper), pipe_(io_context) {}
 
     void start() {
         do_read();
@@ -83,6 +414,19 @@ class Session : public std::enable_shared_from_this<Session> {
     }
 
     void createResponse() {
+        if (envVars.PATH_INFO == "/console") {
+            serveConsolePage();
+            return;
+        }
+        if (envVars.PATH_INFO == "/console/events") {
+            std::make_shared<ConsoleStream>(std::move(socket_), io_context_, envVars.QUERY_STRING)->start();
+            return;
+        }
+        if (envVars.REQUEST_METHOD == "GET" && cgiCache_.isCacheable(envVars.PATH_INFO)) {
+            createCachedResponse();
+            return;
+        }
+
         pid_t pid = fork();
         if (pid < 0) {
             cout << "Error forking" << endl;
@@ -92,6 +436,7 @@ class Session : public std::enable_shared_from_this<Session> {
             dup2(socket_.native_handle(), STDIN_FILENO);
             dup2(socket_.native_handle(), STDOUT_FILENO);
             socket_.close();
+            close_range(3, ~0U, 0); // Don't hold other viewers' connections open
 
             cout << HTTP_OK << flush;
 
@@ -107,16 +452,116 @@ class Session : public std::enable_shared_from_this<Session> {
         }
     }
 
+    // Serves a cache hit without forking, or runs the CGI with its output going
+    // through a pipe so it can be stored
+    void createCachedResponse() {
+        string key = envVars.PATH_INFO + "?" + envVars.QUERY_STRING;
+        const string *cached = cgiCache_.find(key);
+        if (cached != nullptr) {
+            writeResponse(HTTP_OK + *cached);
+            return;
+        }
+
+        int fds[2];
+        if (pipe(fds) < 0) {
+            socket_.close();
+            return;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            cout << "Error forking" << endl;
+            close(fds[0]);
+            close(fds[1]);
+            socket_.close();
+        }
+        else if (pid == 0) {
+            setEnv();
+            dup2(socket_.native_handle(), STDIN_FILENO);
+            dup2(fds[1], STDOUT_FILENO);
+            close_range(3, ~0U, 0);
+
+            string path = "." + envVars.PATH_INFO;
+            cout << envVars.PATH_INFO << endl;
+            cout << path << endl;
+            execlp(path.c_str(), path.c_str(), NULL);
+            cout << "Error executing script" << endl;
+            _exit(EXIT_FAILURE);
+        }
+        else {
+            auto self(shared_from_this());
+            close(fds[1]);
+            pipe_.assign(fds[0]);
+            cgiOutput_.clear();
+            reaper_.watch(pid, [this, self, key](int status) {
+                cgiExited_ = true;
+                cgiStatus_ = status;
+                storeCgiOutput(key);
+            });
+            doReadCgi(key);
+        }
+    }
+
+    void doReadCgi(const string &key) {
+        auto self(shared_from_this());
+        pipe_.async_read_some(
+            boost::asio::buffer(data_, max_length),
+            [this, self, key](boost::system::error_code ec, std::size_t length) {
+                if (!ec) {
+                    cgiOutput_.append(data_, length);
+                    doReadCgi(key);
+                    return;
+                }
+                cgiEof_ = true;
+                writeResponse(HTTP_OK + cgiOutput_);
+                storeCgiOutput(key);
+            });
+    }
+
+    // Only a CGI that ran to a clean exit is worth caching, once all its output is read
+    void storeCgiOutput(const string &key) {
+        if (cgiEof_ && cgiExited_ && WIFEXITED(cgiStatus_) && WEXITSTATUS(cgiStatus_) == 0) {
+            cgiCache_.store(key, envVars.PATH_INFO, cgiOutput_);
+        }
+    }
+
+    void writeResponse(string response) {
+        auto self(shared_from_this());
+        response_ = std::move(response);
+        boost::asio::async_write(
+            socket_,
+            boost::asio::buffer(response_),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                socket_.close(ec);
+            });
+    }
+
+    void serveConsolePage() {
+        vector<ConnectionInfo> connections(MAX_CONNECTION);
+        SocketsServerInfo socketsServer;
+        parseQueryString(envVars.QUERY_STRING, connections, socketsServer);
+        writeResponse(HTTP_OK + "Content-Type: text/html\r\n\r\n" + consoleBody(connections) + consoleScript);
+    }
+
     tcp::socket socket_;
+    boost::asio::io_context &io_context_;
+    CgiCache &cgiCache_;
+    ChildReaper &reaper_;
+    boost::asio::posix::stream_descriptor pipe_; // Output of a cacheable CGI
+    string cgiOutput_;
+    bool cgiEof_ = false;
+    bool cgiExited_ = false;
+    int cgiStatus_ = 0;
     enum { max_length = 1024 };
     char data_[max_length];
+    string response_;
     Environment envVars;
 };
 
 class Server {
   public:
     Server(boost::asio::io_context &io_context, short port)
-        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)) {
+        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), io_context_(io_context), cgiCache_(io_context), reaper_(io_context) {
+        cgiCache_.load("./cgi_cache.conf");
         do_accept();
     }
 
@@ -125,7 +570,7 @@ class Server {
         acceptor_.async_accept(
             [this](boost::system::error_code ec, tcp::socket socket) {
                 if (!ec) {
-                    std::make_shared<Session>(std::move(socket))->start();
+                    std::make_shared<Session>(std::move(socket), io_context_, cgiCache_, reaper_)->start();
                 }
 
                 do_accept();
@@ -133,6 +578,9 @@ class Server {
     }
 
     tcp::acceptor acceptor_;
+    boost::asio::io_context &io_context_;
+    CgiCache cgiCache_;
+    ChildReaper reaper_; // Also reaps the CGIs that write straight to their socket
 };
 
 int main(int argc, char *argv[]) {
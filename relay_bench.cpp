@@ -0,0 +1,357 @@
+// Load generator for the socks_server relay backends (see relay_bench.sh)
+//   ./relay_bench echo <port>
+//     echo server for the tunnels to connect to
+//   ./relay_bench run <socks port> <echo port> <tunnels> <KiB per tunnel>
+//     opens the tunnels through socks_server, keeps them all open, then pushes the
+//     data through every tunnel at once and reads its echo back
+//   ./relay_bench open <socks port> <echo port> <tunnels>
+//     opens the tunnels through socks_server and holds them until killed
+//   ./relay_bench handshake <socks port> <echo port> <count>
+//     times SOCKS4A handshakes one at a time, alternating the compact request of the
+//     console with the 264-byte zero padded one it used to send
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
+
+using boost::asio::ip::tcp;
+using namespace std;
+
+#define SOCKS_VERSION 4
+#define SOCKS_CONNECT 1
+#define SOCKS_GRANTED 90
+#define REPLY_PACKET_SIZE 8
+#define PADDED_REQUEST_SIZE 264
+#define MAX_PENDING_HANDSHAKES 128 // Stay below the listen backlog of socks_server
+
+class EchoSession : public std::enable_shared_from_this<EchoSession> {
+  public:
+    EchoSession(tcp::socket socket) : socket_(std::move(socket)) {}
+
+    void start() {
+        doRead();
+    }
+
+  private:
+    void doRead() {
+        auto self(shared_from_this());
+        socket_.async_read_some(
+            boost::asio::buffer(data_, max_length),
+            [this, self](boost::system::error_code ec, std::size_t length) {
+                if (!ec) {
+                    doWrite(length);
+                }
+            });
+    }
+
+    void doWrite(std::size_t length) {
+        auto self(shared_from_this());
+        boost::asio::async_write(
+            socket_,
+            boost::asio::buffer(data_, length),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (!ec) {
+                    doRead();
+                }
+            });
+    }
+
+    tcp::socket socket_;
+    enum { max_length = 65536 };
+    char data_[max_length];
+};
+
+class EchoServer {
+  public:
+    EchoServer(boost::asio::io_context &io_context, short port)
+        : acceptor_(io_context, tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), port)) {
+        doAccept();
+    }
+
+  private:
+    void doAccept() {
+        acceptor_.async_accept(
+            [this](boost::system::error_code ec, tcp::socket socket) {
+                if (!ec) {
+                    std::make_shared<EchoSession>(std::move(socket))->start();
+                }
+                doAccept();
+            });
+    }
+
+    tcp::acceptor acceptor_;
+};
+
+class Tunnel : public std::enable_shared_from_this<Tunnel> {
+  public:
+    // established: called with whether the SOCKS server granted the tunnel
+    Tunnel(boost::asio::io_context &io_context, std::function<void(bool)> established, std::function<void()> finished)
+        : socket_(io_context), established_(std::move(established)), finished_(std::move(finished)) {}
+
+    void start(const tcp::endpoint &socksServer, unsigned short echoPort, std::size_t bytes) {
+        auto self(shared_from_this());
+        bytes_ = bytes;
+        request_ = {SOCKS_VERSION, SOCKS_CONNECT, (unsigned char)(echoPort / 256), (unsigned char)(echoPort % 256), 127, 0, 0, 1, 0};
+        socket_.async_connect(
+            socksServer,
+            [this, self](boost::system::error_code ec) {
+                if (ec) {
+                    established_(false);
+                    return;
+                }
+                boost::asio::async_write(
+                    socket_,
+                    boost::asio::buffer(request_),
+                    [this, self](boost::system::error_code ec, std::size_t) {
+                        if (ec) {
+                            established_(false);
+                            return;
+                        }
+                        boost::asio::async_read(
+                            socket_,
+                            boost::asio::buffer(reply_, REPLY_PACKET_SIZE),
+                            [this, self](boost::system::error_code ec, std::size_t) {
+                                granted_ = !ec && reply_[1] == SOCKS_GRANTED;
+                                established_(granted_);
+                            });
+                    });
+            });
+    }
+
+    void transfer() {
+        if (!granted_) {
+            return;
+        }
+        memset(out_, 'x', max_length);
+        doWrite();
+        doRead();
+    }
+
+    // Keeps the tunnel open until the server closes it
+    void hold() {
+        if (!granted_) {
+            return;
+        }
+        bytes_ = SIZE_MAX;
+        doRead();
+    }
+
+  private:
+    void doWrite() {
+        auto self(shared_from_this());
+        std::size_t length = std::min<std::size_t>(max_length, bytes_ - written_);
+        boost::asio::async_write(
+            socket_,
+            boost::asio::buffer(out_, length),
+            [this, self](boost::system::error_code ec, std::size_t length) {
+                written_ += length;
+                if (!ec && written_ < bytes_) {
+                    doWrite();
+                }
+            });
+    }
+
+    void doRead() {
+        auto self(shared_from_this());
+        socket_.async_read_some(
+            boost::asio::buffer(in_, max_length),
+            [this, self](boost::system::error_code ec, std::size_t length) {
+                read_ += length;
+                if (!ec && read_ < bytes_) {
+                    doRead();
+                    return;
+                }
+                socket_.close(ec);
+                finished_();
+            });
+    }
+
+    tcp::socket socket_;
+    std::function<void(bool)> established_;
+    std::function<void()> finished_;
+    vector<unsigned char> request_;
+    unsigned char reply_[REPLY_PACKET_SIZE];
+    bool granted_ = false;
+    enum { max_length = 65536 };
+    char out_[max_length];
+    char in_[max_length];
+    std::size_t bytes_ = 0;
+    std::size_t written_ = 0;
+    std::size_t read_ = 0;
+};
+
+class LoadGenerator {
+  public:
+    // hold: keep the tunnels open instead of pushing data through them
+    LoadGenerator(boost::asio::io_context &io_context, short socksPort, short echoPort, int tunnels, std::size_t bytes, bool hold)
+        : io_context_(io_context), socksServer_(boost::asio::ip::make_address("127.0.0.1"), socksPort),
+          echoPort_(echoPort), tunnels_(tunnels), bytes_(bytes), hold_(hold) {}
+
+    void start() {
+        begin_ = std::chrono::steady_clock::now();
+        for (int i = 0; i < MAX_PENDING_HANDSHAKES && i < tunnels_; i++) {
+            openTunnel();
+        }
+    }
+
+  private:
+    void openTunnel() {
+        auto tunnel = std::make_shared<Tunnel>(
+            io_context_,
+            [this](bool granted) { tunnelEstablished(granted); },
+            [this]() { tunnelFinished(); });
+        tunnel->start(socksServer_, echoPort_, bytes_);
+        open_.push_back(tunnel);
+    }
+
+    void tunnelEstablished(bool granted) {
+        if (granted) {
+            established_++;
+        }
+        else {
+            failed_++;
+        }
+        if ((int)open_.size() < tunnels_) {
+            openTunnel();
+        }
+        if (established_ + failed_ < tunnels_) {
+            return;
+        }
+        if (hold_) {
+            cout << "tunnels " << established_ << " (failed " << failed_ << ") open" << endl;
+            for (auto &tunnel : open_) {
+                tunnel->hold();
+            }
+            return;
+        }
+        // Every tunnel is up: push data through all of them at once
+        setup_ = std::chrono::steady_clock::now();
+        if (established_ == 0) {
+            report();
+            return;
+        }
+        for (auto &tunnel : open_) {
+            tunnel->transfer();
+        }
+    }
+
+    void tunnelFinished() {
+        if (++finished_ < established_) {
+            return;
+        }
+        if (hold_) {
+            cout << "tunnels closed by the server" << endl;
+            io_context_.stop();
+            return;
+        }
+        report();
+    }
+
+    void report() {
+        auto end = std::chrono::steady_clock::now();
+        double setup = std::chrono::duration<double>(setup_ - begin_).count();
+        double transfer = std::chrono::duration<double>(end - setup_).count();
+        double megabytes = 2.0 * bytes_ * established_ / 1048576; // Both directions
+        cout << "tunnels " << established_ << " (failed " << failed_ << "), setup " << setup << " s, transfer "
+             << transfer << " s, " << megabytes / transfer << " MB/s" << endl;
+        open_.clear();
+        io_context_.stop();
+    }
+
+    boost::asio::io_context &io_context_;
+    tcp::endpoint socksServer_;
+    unsigned short echoPort_;
+    int tunnels_;
+    std::size_t bytes_;
+    bool hold_;
+    vector<std::shared_ptr<Tunnel>> open_;
+    int established_ = 0;
+    int failed_ = 0;
+    int finished_ = 0;
+    std::chrono::steady_clock::time_point begin_;
+    std::chrono::steady_clock::time_point setup_;
+};
+
+// Connect to grant time of one SOCKS4A request for localhost:<echo port>, in microseconds
+double timeHandshake(boost::asio::io_context &io_context, const tcp::endpoint &socksServer, unsigned short echoPort, bool padded) {
+    string host = "localhost";
+    vector<unsigned char> request = {SOCKS_VERSION, SOCKS_CONNECT, (unsigned char)(echoPort / 256), (unsigned char)(echoPort % 256), 0, 0, 0, 1, 0};
+    request.insert(request.end(), host.begin(), host.end());
+    request.push_back(0);
+    if (padded) {
+        request.resize(PADDED_REQUEST_SIZE);
+    }
+    unsigned char reply[REPLY_PACKET_SIZE];
+    auto begin = std::chrono::steady_clock::now();
+    tcp::socket socket(io_context);
+    socket.connect(socksServer);
+    boost::asio::write(socket, boost::asio::buffer(request));
+    boost::asio::read(socket, boost::asio::buffer(reply, REPLY_PACKET_SIZE));
+    auto end = std::chrono::steady_clock::now();
+    if (reply[1] != SOCKS_GRANTED) {
+        throw runtime_error("handshake rejected");
+    }
+    return std::chrono::duration<double, std::micro>(end - begin).count();
+}
+
+void reportHandshakes(const string &name, vector<double> &times) {
+    std::sort(times.begin(), times.end());
+    double sum = 0;
+    for (double time : times) {
+        sum += time;
+    }
+    cout << name << ": mean " << sum / times.size() << " us, p50 " << times[times.size() / 2] << " us, p99 "
+         << times[times.size() * 99 / 100] << " us" << endl;
+}
+
+void compareHandshakes(boost::asio::io_context &io_context, short socksPort, short echoPort, int count) {
+    tcp::endpoint socksServer(boost::asio::ip::make_address("127.0.0.1"), socksPort);
+    vector<double> compact, padded;
+    for (int i = 0; i < count; i++) {
+        compact.push_back(timeHandshake(io_context, socksServer, echoPort, false));
+        padded.push_back(timeHandshake(io_context, socksServer, echoPort, true));
+    }
+    reportHandshakes("compact request", compact);
+    reportHandshakes("padded request ", padded);
+}
+
+int main(int argc, char *argv[]) {
+    try {
+        boost::asio::io_context io_context;
+        if (argc == 3 && string(argv[1]) == "echo") {
+            EchoServer server(io_context, std::atoi(argv[2]));
+            io_context.run();
+        }
+        else if (argc == 6 && string(argv[1]) == "run") {
+            LoadGenerator generator(io_context, std::atoi(argv[2]), std::atoi(argv[3]), std::atoi(argv[4]), std::atoll(argv[5]) * 1024, false);
+            generator.start();
+            io_context.run();
+        }
+        else if (argc == 5 && string(argv[1]) == "open") {
+            LoadGenerator generator(io_context, std::atoi(argv[2]), std::atoi(argv[3]), std::atoi(argv[4]), 0, true);
+            generator.start();
+            io_context.run();
+        }
+        else if (argc == 5 && string(argv[1]) == "handshake") {
+            compareHandshakes(io_context, std::atoi(argv[2]), std::atoi(argv[3]), std::atoi(argv[4]));
+        }
+        else {
+            std::cerr << "Usage: relay_bench echo <port>\n"
+                      << "       relay_bench run <socks port> <echo port> <tunnels> <KiB per tunnel>\n"
+                      << "       relay_bench open <socks port> <echo port> <tunnels>\n"
+                      << "       relay_bench handshake <socks port> <echo port> <count>\n";
+            return 1;
+        }
+    } catch (std::exception &e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Compares the Asio and io_uring relay backends of socks_server ("relay" in socks.conf)
+# with many concurrent tunnels. Build with "make && make relay_bench", then run
+#   [BACKENDS="asio uring"] ./relay_bench.sh [KiB per tunnel] [tunnels ...]      (default: 256 1000 4000)
+# For every backend and tunnel count it prints the load generator's numbers, the CPU
+# time of socks_server together with its session processes, and the syscalls of the
+# relays (socks_server_syscalls). Every tunnel costs about 0.9 MB of memory (its session
+# process and the buffers of socks_server, relay_bench and the echo server), so 10000
+# tunnels need some 9 GB.
+KIB=${1:-256}
+[ $# -gt 0 ] && shift
+TUNNELS=${*:-1000 4000}
+SOCKS_PORT=${SOCKS_PORT:-17080}
+ECHO_PORT=${ECHO_PORT:-17081}
+HERE=$(cd "$(dirname "$0")" && pwd)
+DIR=$(mktemp -d)
+trap 'kill $ECHO 2>/dev/null; rm -rf "$DIR"' EXIT
+
+ulimit -n "$(ulimit -Hn)"
+"$HERE/relay_bench" echo "$ECHO_PORT" &
+ECHO=$!
+
+# CPU seconds of a process and its reaped children (utime stime cutime cstime)
+cpu() {
+  awk -v hz="$(getconf CLK_TCK)" '{ printf "%.2f", ($14 + $15 + $16 + $17) / hz }' "/proc/$1/stat"
+}
+
+for backend in ${BACKENDS:-asio uring}; do
+  printf 'permit c *.*.*.*\nrelay %s\n' "$backend" >"$DIR/socks.conf"
+  for tunnels in $TUNNELS; do
+    (cd "$DIR" && exec "$HERE/socks_server_syscalls" "$SOCKS_PORT" >/dev/null 2>"$DIR/counts") &
+    SOCKS=$!
+    sleep 0.5
+    printf '%-6s ' "$backend"
+    "$HERE/relay_bench" run "$SOCKS_PORT" "$ECHO_PORT" "$tunnels" "$KIB" | tee "$DIR/result"
+    # Wait for the sessions to exit and be reaped, so their CPU time is counted
+    while pgrep -P $SOCKS >/dev/null; do
+      sleep 0.2
+    done
+    TRANSFER=$(awk '{ for (i = 1; i < NF; i++) if ($(i + 1) == "s," && $(i - 1) == "transfer") print $i }' "$DIR/result")
+    awk -v cpu="$(cpu $SOCKS)" -v seconds="$TRANSFER" '
+      /^relay: / { syscalls += $2 }
+      END { printf "       socks_server CPU %s s, %d syscalls, %.0f syscalls/s\n", cpu, syscalls, syscalls / seconds }' "$DIR/counts"
+    kill $SOCKS
+    wait $SOCKS 2>/dev/null
+  done
+done
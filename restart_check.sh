@@ -0,0 +1,69 @@
+#!/bin/sh
+# Checks that a second socks_server started on the same port takes the listener over
+# without refusing or failing a single handshake, and that the old instance exits once its
+# last tunnels close. Run by "make restart_check". relay_bench keeps doing SOCKS CONNECT
+# handshakes in a loop while the new instance starts; a few tunnels held open through the
+# old instance keep it draining until they are closed.
+TUNNELS=4
+SOCKS_PORT=${SOCKS_PORT:-17310}
+ECHO_PORT=${ECHO_PORT:-17311}
+HERE=$(cd "$(dirname "$0")" && pwd)
+DIR=$(mktemp -d)
+trap 'kill $ECHO $OLD $NEW $HOLD $LOOP 2>/dev/null; rm -rf "$DIR"' EXIT
+
+printf 'permit c *.*.*.*\n' >"$DIR/socks.conf"
+
+"$HERE/relay_bench" echo "$ECHO_PORT" &
+ECHO=$!
+(cd "$DIR" && exec "$HERE/socks_server" "$SOCKS_PORT" >old.log 2>&1) &
+OLD=$!
+sleep 1
+
+"$HERE/relay_bench" open "$SOCKS_PORT" "$ECHO_PORT" "$TUNNELS" &
+HOLD=$!
+# relay_bench reports a refused or rejected handshake as "Exception: ..."
+(while [ ! -e "$DIR/stop" ]; do
+  "$HERE/relay_bench" handshake "$SOCKS_PORT" "$ECHO_PORT" 50 >>"$DIR/handshakes" 2>&1
+done) &
+LOOP=$!
+sleep 1
+
+(cd "$DIR" && exec "$HERE/socks_server" "$SOCKS_PORT" >new.log 2>&1) &
+NEW=$!
+sleep 2
+touch "$DIR/stop"
+wait $LOOP
+ROUNDS=$(grep -c "compact request" "$DIR/handshakes")
+FAILED=$(grep -c "Exception" "$DIR/handshakes")
+echo "handshake rounds: $ROUNDS, failed: $FAILED"
+grep "Exception" "$DIR/handshakes"
+grep "Handed over" "$DIR/old.log"
+
+STATUS=0
+if [ "$FAILED" -ne 0 ] || [ "$ROUNDS" -eq 0 ] || ! grep -q "Handed over" "$DIR/old.log"; then
+  STATUS=1
+fi
+if ! kill -0 $OLD 2>/dev/null; then
+  echo "old instance exited with tunnels still open"
+  STATUS=1
+fi
+
+kill $HOLD
+wait $HOLD 2>/dev/null
+WAITED=0
+while kill -0 $OLD 2>/dev/null && [ $WAITED -lt 10 ]; do
+  sleep 1
+  WAITED=$((WAITED + 1))
+done
+if kill -0 $OLD 2>/dev/null; then
+  echo "old instance still running after its tunnels closed"
+  STATUS=1
+else
+  echo "old instance exited after its tunnels closed"
+fi
+
+if [ $STATUS -ne 0 ]; then
+  echo "FAIL"
+  exit 1
+fi
+echo "OK"
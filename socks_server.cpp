@@ -1,11 +1,29 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cstdlib>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <fcntl.h>
 #include <iostream>
+#include <linux/io_uring.h>
+#include <map>
 #include <memory>
+#include <netinet/tcp.h>
+#include <random>
 #include <regex>
+#include <set>
 #include <sstream>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <type_traits>
 #include <utility>
 
 using boost::asio::ip::tcp;
@@ -17,7 +35,539 @@ using namespace std;
 #define SOCKS_GRANTED 90
 #define SOCKS_REJECTED 91
 #define REQUEST_PACKET_SIZE 264
+#define REQUEST_HEADER_SIZE 9 // VN CD DSTPORT(2) DSTIP(4) NULL
 #define REPLY_PACKET_SIZE 8
+#define BIND_ACCEPT_TIMEOUT 120 // seconds
+#define LISTEN_FASTOPEN_QUEUE 16
+#define SOCKS5_VERSION 5
+#define PROBE_INTERVAL 10 // seconds
+#define PROBE_TIMEOUT 2   // seconds
+#define DRAIN_TIMEOUT 60  // seconds
+#define HANDOVER_TIMEOUT 10 // seconds for a new instance to confirm it is listening
+#define HANDOVER_ACK 'L'
+#define PID_MAX_LIMIT 4194304 // Highest pid_max of 64-bit Linux
+#define SOCKS_MUX 0x80    // Extension: one connection carries many CONNECT streams, see MuxSession
+#define MUX_OPEN 1
+#define MUX_REPLY 2
+#define MUX_DATA 3
+#define MUX_CLOSE 4
+#define MUX_HEADER_SIZE 4
+#define MUX_USE_SOCKS4 1 // MUX_REPLY code: open this stream as a plain SOCKS4 connection instead
+#define MUX_STREAM_WINDOW 262144 // Bytes queued for one stream's server before the stream is closed
+
+// Recycled storage for the handler of one async operation at a time, so the
+// relay loop does not allocate for every chunk (see Asio's allocation example)
+class HandlerMemory {
+  public:
+    HandlerMemory() : inUse_(false) {}
+    HandlerMemory(const HandlerMemory &) = delete;
+    HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+    void *allocate(std::size_t size) {
+        if (!inUse_ && size <= sizeof(storage_)) {
+            inUse_ = true;
+            return &storage_;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void *pointer) {
+        if (pointer == &storage_) {
+            inUse_ = false;
+        }
+        else {
+            ::operator delete(pointer);
+        }
+    }
+
+  private:
+    typename std::aligned_storage<1024>::type storage_;
+    bool inUse_;
+};
+
+template <typename T>
+class HandlerAllocator {
+  public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory &memory) : memory_(memory) {}
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U> &other) noexcept : memory_(other.memory_) {}
+
+    bool operator==(const HandlerAllocator &other) const noexcept { return &memory_ == &other.memory_; }
+    bool operator!=(const HandlerAllocator &other) const noexcept { return &memory_ != &other.memory_; }
+
+    T *allocate(std::size_t n) const { return static_cast<T *>(memory_.allocate(sizeof(T) * n)); }
+    void deallocate(T *pointer, std::size_t /*n*/) const { memory_.deallocate(pointer); }
+
+  private:
+    template <typename>
+    friend class HandlerAllocator;
+
+    HandlerMemory &memory_;
+};
+
+// Wraps a handler so Asio picks up HandlerAllocator as its associated allocator
+template <typename Handler>
+class CustomAllocHandler {
+  public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    CustomAllocHandler(HandlerMemory &memory, Handler handler)
+        : memory_(memory), handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept { return allocator_type(memory_); }
+
+    template <typename... Args>
+    void operator()(Args &&...args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+  private:
+    HandlerMemory &memory_;
+    Handler handler_;
+};
+
+template <typename Handler>
+inline CustomAllocHandler<Handler> makeCustomAllocHandler(HandlerMemory &memory, Handler handler) {
+    return CustomAllocHandler<Handler>(memory, std::move(handler));
+}
+
+// Socket options selected per firewall rule with "profile=<name>" in socks.conf and
+// adjusted by the rcvbuf=, sndbuf=, keepidle=, lowat= and nodelay options of the same rule,
+// 0 / false leaves the system default
+struct SocketProfile {
+    bool noDelay = false;
+    int receiveBuffer = 0;
+    int sendBuffer = 0;
+    int keepAliveIdle = 0; // seconds
+    int notSentLowat = 0;
+};
+
+const map<string, SocketProfile> socketProfiles = {
+    {"default", SocketProfile()},
+    // RAS/RWG shells: small writes should leave at once
+    {"interactive", [] {
+         SocketProfile profile;
+         profile.noDelay = true;
+         profile.keepAliveIdle = 60;
+         profile.notSentLowat = 16 * 1024;
+         return profile;
+     }()},
+    // Large downloads: big socket buffers
+    {"bulk", [] {
+         SocketProfile profile;
+         profile.receiveBuffer = 4 * 1024 * 1024;
+         profile.sendBuffer = 4 * 1024 * 1024;
+         profile.keepAliveIdle = 60;
+         return profile;
+     }()},
+};
+
+const SocketProfile &getSocketProfile(const string &name) {
+    auto it = socketProfiles.find(name);
+    if (it == socketProfiles.end()) {
+        cerr << "socks.conf: unknown profile \"" << name << "\", using default" << endl;
+        return socketProfiles.at("default");
+    }
+    return it->second;
+}
+
+// Options that have to be set before connect(). TCP Fast Open is deliberately not used
+// upstream: with a cached cookie connect() succeeds before the destination has answered,
+// so a grant could go out for an unreachable host, and servers that speak first (the
+// RAS/RWG shells) would wait for client data that never comes.
+void applyConnectOptions(tcp::socket &socket, const SocketProfile &profile) {
+    boost::system::error_code ec;
+    if (profile.receiveBuffer) {
+        socket.set_option(boost::asio::socket_base::receive_buffer_size(profile.receiveBuffer), ec);
+    }
+}
+
+void applySocketProfile(tcp::socket &socket, const SocketProfile &profile) {
+    boost::system::error_code ec;
+    if (profile.noDelay) {
+        socket.set_option(tcp::no_delay(true), ec);
+    }
+    if (profile.receiveBuffer) {
+        socket.set_option(boost::asio::socket_base::receive_buffer_size(profile.receiveBuffer), ec);
+    }
+    if (profile.sendBuffer) {
+        socket.set_option(boost::asio::socket_base::send_buffer_size(profile.sendBuffer), ec);
+    }
+    if (profile.keepAliveIdle) {
+        socket.set_option(boost::asio::socket_base::keep_alive(true), ec);
+        setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_KEEPIDLE, &profile.keepAliveIdle, sizeof(profile.keepAliveIdle));
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    if (profile.notSentLowat) {
+        setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_NOTSENT_LOWAT, &profile.notSentLowat, sizeof(profile.notSentLowat));
+    }
+#endif
+}
+
+// A parent SOCKS server that CONNECT requests can be forwarded through
+struct ParentProxy {
+    int version; // 4 or 5
+    string host;
+    string port;
+};
+
+// Per-parent state shared by every forked session
+struct ParentProxyStats {
+    std::atomic<unsigned int> active;
+    std::atomic<unsigned int> latencyUs;
+    std::atomic<bool> healthy;
+};
+
+struct UpstreamGroup {
+    string policy;                 // roundrobin, leastconn or latency
+    vector<int> parents;           // Indexes into UpstreamPool::parents_
+    std::atomic<unsigned int> *next; // Round robin position, shared
+};
+
+// Groups of parent proxies, from lines in socks.conf like
+//   upstream <name> <roundrobin|leastconn|latency> socks4://<host>:<port> socks5://<host>:<port> ...
+// Sessions live in forked processes, so the counters the policies need are kept in
+// an anonymous shared mapping created by load() before the first fork.
+class UpstreamPool {
+  public:
+    void load(const string &path) {
+        string line;
+        ifstream file(path);
+        regex url("socks([45])://([^:]+):([0-9]+)");
+        vector<string> groupNames;
+        while (getline(file, line)) {
+            vector<string> tokens;
+            boost::split(tokens, line, boost::is_any_of(" "), boost::token_compress_on);
+            if (tokens.size() < 4 || tokens[0] != "upstream") {
+                continue;
+            }
+            UpstreamGroup &group = groups_[tokens[1]];
+            group.policy = tokens[2];
+            for (size_t i = 3; i < tokens.size(); i++) {
+                smatch match;
+                if (regex_match(tokens[i], match, url)) {
+                    group.parents.push_back(parents_.size());
+                    parents_.push_back(ParentProxy{stoi(match[1]), match[2], match[3]});
+                }
+            }
+        }
+        file.close();
+        if (parents_.empty()) {
+            return;
+        }
+
+        size_t size = sizeof(ParentProxyStats) * parents_.size() + sizeof(std::atomic<unsigned int>) * groups_.size();
+        void *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared == MAP_FAILED) {
+            throw runtime_error("mmap upstream stats failed");
+        }
+        stats_ = static_cast<ParentProxyStats *>(shared);
+        for (size_t i = 0; i < parents_.size(); i++) {
+            new (&stats_[i].active) std::atomic<unsigned int>(0);
+            new (&stats_[i].latencyUs) std::atomic<unsigned int>(0);
+            new (&stats_[i].healthy) std::atomic<bool>(true); // Until the first probe says otherwise
+        }
+        std::atomic<unsigned int> *counters = reinterpret_cast<std::atomic<unsigned int> *>(stats_ + parents_.size());
+        for (auto &group : groups_) {
+            group.second.next = new (counters++) std::atomic<unsigned int>(0);
+        }
+
+        // Parent in use by each session process, indexed by pid. Pages are only backed
+        // once touched, so covering every possible pid costs nothing up front.
+        shared = mmap(NULL, sizeof(std::atomic<int>) * PID_MAX_LIMIT, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (shared == MAP_FAILED) {
+            throw runtime_error("mmap upstream sessions failed");
+        }
+        sessionParents_ = static_cast<std::atomic<int> *>(shared); // Zero filled: no parent
+    }
+
+    // Picks a parent of the group and counts it as in use by the calling session process
+    // until the main process reaps it, -1 if there is none
+    int select(const string &name) {
+        auto it = groups_.find(name);
+        if (it == groups_.end() || it->second.parents.empty()) {
+            return -1;
+        }
+        UpstreamGroup &group = it->second;
+        vector<int> candidates;
+        for (int index : group.parents) {
+            if (stats_[index].healthy) {
+                candidates.push_back(index);
+            }
+        }
+        if (candidates.empty()) {
+            candidates = group.parents; // None known healthy, try them anyway
+        }
+
+        int chosen = candidates[0];
+        if (group.policy == "leastconn") {
+            for (int index : candidates) {
+                if (stats_[index].active < stats_[chosen].active) {
+                    chosen = index;
+                }
+            }
+        }
+        else if (group.policy == "latency") {
+            // Weighted random choice, a parent twice as fast is picked about twice as often
+            static std::mt19937 generator(getpid() ^ std::chrono::steady_clock::now().time_since_epoch().count());
+            vector<double> weights;
+            for (int index : candidates) {
+                weights.push_back(1e6 / (stats_[index].latencyUs + 1000.0));
+            }
+            std::discrete_distribution<int> distribution(weights.begin(), weights.end());
+            chosen = candidates[distribution(generator)];
+        }
+        else {
+            chosen = candidates[group.next->fetch_add(1) % candidates.size()];
+        }
+        stats_[chosen].active++;
+        sessionParents_[getpid()] = chosen + 1;
+        return chosen;
+    }
+
+    // Called by the main process for every session it reaps, however the session ended
+    void release(pid_t pid) {
+        if (sessionParents_ == nullptr) {
+            return;
+        }
+        int index = sessionParents_[pid].exchange(0) - 1;
+        if (index >= 0) {
+            stats_[index].active--;
+        }
+    }
+
+    void setProbeResult(int index, bool healthy, unsigned int latencyUs) {
+        stats_[index].healthy = healthy;
+        if (healthy) {
+            stats_[index].latencyUs = latencyUs;
+        }
+    }
+
+    const ParentProxy &parent(int index) const {
+        return parents_[index];
+    }
+
+    int size() const {
+        return parents_.size();
+    }
+
+  private:
+    vector<ParentProxy> parents_;
+    map<string, UpstreamGroup> groups_;
+    ParentProxyStats *stats_ = nullptr;
+    std::atomic<int> *sessionParents_ = nullptr; // Parent index + 1 per session pid, 0 for none
+};
+
+UpstreamPool upstreamPool;
+
+// Handshake stage tracing, compiled in with "make TRACE=1" and switched on at run time
+// by setting SOCKS_TRACE_DIR. Every session process then writes the stages of its
+// handshake as Chrome trace events (chrome://tracing, Perfetto) to
+// $SOCKS_TRACE_DIR/trace_<pid>.json.
+#ifdef SOCKS_TRACE
+struct TraceEvent {
+    const char *stage;
+    std::chrono::steady_clock::time_point begin; // Each stage lasts until the next one begins
+};
+
+const char *traceDir = getenv("SOCKS_TRACE_DIR");
+thread_local vector<TraceEvent> traceEvents;
+
+inline void traceStage(const char *stage) {
+    if (traceDir == nullptr) {
+        return;
+    }
+    traceEvents.push_back(TraceEvent{stage, std::chrono::steady_clock::now()});
+}
+
+// Rewrites the whole file, so a BIND session's second reply extends the first capture
+void traceFlush() {
+    if (traceDir == nullptr || traceEvents.empty()) {
+        return;
+    }
+    auto end = std::chrono::steady_clock::now();
+    ofstream file(string(traceDir) + "/trace_" + to_string(getpid()) + ".json");
+    file << "[";
+    for (size_t i = 0; i < traceEvents.size(); i++) {
+        auto until = i + 1 < traceEvents.size() ? traceEvents[i + 1].begin : end;
+        auto ts = std::chrono::duration_cast<std::chrono::microseconds>(traceEvents[i].begin.time_since_epoch()).count();
+        auto dur = std::chrono::duration_cast<std::chrono::microseconds>(until - traceEvents[i].begin).count();
+        file << (i ? ",\n" : "\n") << R"({"name":")" << traceEvents[i].stage << R"(","cat":"handshake","ph":"X","ts":)" << ts
+             << R"(,"dur":)" << dur << R"(,"pid":)" << getpid() << R"(,"tid":1})";
+    }
+    file << "\n]\n";
+}
+
+#define TRACE_STAGE(stage) traceStage(stage)
+#define TRACE_FLUSH() traceFlush()
+#else
+#define TRACE_STAGE(stage) ((void)0)
+#define TRACE_FLUSH() ((void)0)
+#endif
+
+// Allocation counting for alloc_check.sh, compiled in with -DSOCKS_ALLOC_COUNT ("make
+// alloc_check"): every session reports how many times operator new ran while its Asio
+// relay loop moved how many chunks.
+#ifdef SOCKS_ALLOC_COUNT
+unsigned long allocationCount = 0; // Sessions are single threaded processes
+unsigned long relayAllocationBase = 0;
+unsigned long relayChunks = 0;
+
+void *operator new(std::size_t size) {
+    allocationCount++;
+    void *pointer = malloc(size ? size : 1);
+    if (pointer == NULL) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void operator delete(void *pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept {
+    free(pointer);
+}
+
+#define ALLOC_COUNT_START() (relayAllocationBase = allocationCount, relayChunks = 0)
+#define ALLOC_COUNT_CHUNK() (relayChunks++)
+#define ALLOC_COUNT_REPORT() \
+    (cerr << "relay: " << relayChunks << " chunks, " << allocationCount - relayAllocationBase << " allocations" << endl)
+#else
+#define ALLOC_COUNT_START() ((void)0)
+#define ALLOC_COUNT_CHUNK() ((void)0)
+#define ALLOC_COUNT_REPORT() ((void)0)
+#endif
+
+// Syscall counting for relay_bench.sh, compiled in with -DSOCKS_SYSCALL_COUNT and the
+// linker wrapping the calls of the Asio loop ("make relay_bench" builds it as
+// socks_server_syscalls): every session reports the receive, send and wait syscalls of its
+// relay, io_uring_enter() for the io_uring backend.
+#ifdef SOCKS_SYSCALL_COUNT
+unsigned long syscallCount = 0;
+
+extern "C" {
+ssize_t __real_recvmsg(int fd, msghdr *message, int flags);
+ssize_t __real_sendmsg(int fd, const msghdr *message, int flags);
+int __real_epoll_wait(int epfd, epoll_event *events, int maxEvents, int timeout);
+
+ssize_t __wrap_recvmsg(int fd, msghdr *message, int flags) {
+    syscallCount++;
+    return __real_recvmsg(fd, message, flags);
+}
+
+ssize_t __wrap_sendmsg(int fd, const msghdr *message, int flags) {
+    syscallCount++;
+    return __real_sendmsg(fd, message, flags);
+}
+
+int __wrap_epoll_wait(int epfd, epoll_event *events, int maxEvents, int timeout) {
+    syscallCount++;
+    return __real_epoll_wait(epfd, events, maxEvents, timeout);
+}
+}
+
+#define SYSCALL_COUNT_START() (syscallCount = 0)
+#define SYSCALL_COUNT() (syscallCount++)
+#define SYSCALL_COUNT_REPORT() (cerr << "relay: " << syscallCount << " syscalls" << endl)
+#else
+#define SYSCALL_COUNT_START() ((void)0)
+#define SYSCALL_COUNT() ((void)0)
+#define SYSCALL_COUNT_REPORT() ((void)0)
+#endif
+
+// Rule: permit <c|b> <ip pattern> [profile=<name>] [rcvbuf=<bytes>] [sndbuf=<bytes>]
+//       [keepidle=<seconds>] [lowat=<bytes>] [nodelay] [upstream=<group>]
+// Returns whether a rule of socks.conf permits the request, with the tokens of that rule
+bool matchFirewallRule(int command, const string &dstIp, vector<string> &rule) {
+    string line;
+    ifstream file("./socks.conf");
+    bool isPermit = false;
+    while (getline(file, line)) {
+        vector<string> tokens;
+        boost::split(tokens, line, boost::is_any_of(" "), boost::token_compress_on);
+        if (tokens.size() >= 3) {
+            if (tokens[0] == "permit") {
+                tokens[2] = regex_replace(tokens[2], regex("\\."), "\\.");  // Replace . with \.
+                tokens[2] = regex_replace(tokens[2], regex("\\*"), "\\d+"); // Replace * with \d+
+                regex ip(tokens[2]);
+                if (command == SOCKS_CONNECT && tokens[1] == "c") {
+                    if (regex_match(dstIp, ip)) {
+                        isPermit = true;
+                    }
+                }
+                else if (command == SOCKS_BIND && tokens[1] == "b") {
+                    if (regex_match(dstIp, ip)) {
+                        isPermit = true;
+                    }
+                }
+                if (isPermit) {
+                    rule = tokens;
+                    break;
+                }
+            }
+        }
+    }
+    file.close();
+    return isPermit;
+}
+
+// Value of a numeric rule option such as "rcvbuf=65536", -1 (with a warning) if it is not a
+// non-negative number
+int parseOptionValue(const string &option) {
+    string value = option.substr(option.find('=') + 1);
+    if (value.empty() || value.size() > 9 || value.find_first_not_of("0123456789") != string::npos) {
+        cerr << "socks.conf: ignoring invalid option \"" << option << "\"" << endl;
+        return -1;
+    }
+    return stoi(value);
+}
+
+void parseRuleOptions(const vector<string> &tokens, SocketProfile &profile, string &upstreamGroup) {
+    // The preset first, so the explicit options override it wherever they appear in the rule
+    for (size_t i = 3; i < tokens.size() && !boost::starts_with(tokens[i], "#"); i++) {
+        if (boost::starts_with(tokens[i], "profile=")) {
+            profile = getSocketProfile(tokens[i].substr(8));
+        }
+    }
+    for (size_t i = 3; i < tokens.size() && !boost::starts_with(tokens[i], "#"); i++) {
+        int value = -1;
+        if (boost::starts_with(tokens[i], "upstream=")) {
+            upstreamGroup = tokens[i].substr(9);
+        }
+        else if (boost::starts_with(tokens[i], "rcvbuf=")) {
+            if ((value = parseOptionValue(tokens[i])) >= 0) {
+                profile.receiveBuffer = value;
+            }
+        }
+        else if (boost::starts_with(tokens[i], "sndbuf=")) {
+            if ((value = parseOptionValue(tokens[i])) >= 0) {
+                profile.sendBuffer = value;
+            }
+        }
+        else if (boost::starts_with(tokens[i], "keepidle=")) {
+            if ((value = parseOptionValue(tokens[i])) >= 0) {
+                profile.keepAliveIdle = value;
+            }
+        }
+        else if (boost::starts_with(tokens[i], "lowat=")) {
+            if ((value = parseOptionValue(tokens[i])) >= 0) {
+                profile.notSentLowat = value;
+            }
+        }
+        else if (tokens[i] == "nodelay") {
+            profile.noDelay = true;
+        }
+        else if (!tokens[i].empty() && !boost::starts_with(tokens[i], "profile=")) {
+            cerr << "socks.conf: ignoring unknown option \"" << tokens[i] << "\"" << endl;
+        }
+    }
+}
 
 struct SocketsPacket {
     int VN;
@@ -27,11 +577,744 @@ struct SocketsPacket {
     string DOMAIN_NAME;
 };
 
+// Relay backend of the session processes, "relay <asio|uring>" in socks.conf
+enum RelayBackend { RELAY_ASIO, RELAY_URING };
+
+RelayBackend relayBackend = RELAY_ASIO;
+
+void loadRelayBackend(const string &path) {
+    string line;
+    ifstream file(path);
+    while (getline(file, line)) {
+        vector<string> tokens;
+        boost::split(tokens, line, boost::is_any_of(" "), boost::token_compress_on);
+        if (tokens.size() >= 2 && tokens[0] == "relay") {
+            relayBackend = tokens[1] == "uring" ? RELAY_URING : RELAY_ASIO;
+        }
+    }
+    file.close();
+}
+
+// io_uring relay loop, used through the raw syscalls so no liburing is needed. A single
+// io_uring_enter() both submits the next operations and waits for completions, where the
+// Asio loop needs an epoll_wait plus a recv and a send per chunk.
+//
+// Where the kernel has it (6.0), each direction keeps one multishot RECV armed that picks
+// buffers from a ring provided to the kernel, so the next chunks are received while the
+// last one is still being sent. Older kernels get one RECV at a time, into buffers
+// registered with the ring (READ_FIXED) when they allow it.
+//
+// A RECV and its SEND are not linked (IOSQE_IO_LINK): the SEND would have to be prepared
+// with a length before the RECV tells how much arrived. Sends use plain SEND rather than
+// WRITE_FIXED, which has no MSG_NOSIGNAL.
+class UringRelay {
+  public:
+    UringRelay() {}
+    UringRelay(const UringRelay &) = delete;
+    UringRelay &operator=(const UringRelay &) = delete;
+
+    ~UringRelay() {
+        if (bufferRings_ != MAP_FAILED) {
+            munmap(bufferRings_, 2 * URING_PAGE_SIZE);
+        }
+        if (providedBuffers_ != MAP_FAILED) {
+            munmap(providedBuffers_, 2 * URING_BUFFERS * directions_[0].capacity);
+        }
+        if (sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqesSize_);
+        }
+        if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_) {
+            munmap(cqRing_, cqRingSize_);
+        }
+        if (sqRing_ != MAP_FAILED) {
+            munmap(sqRing_, sqRingSize_);
+        }
+        if (ringFd_ >= 0) {
+            close(ringFd_);
+        }
+    }
+
+    // False if the kernel has no io_uring (or it is disabled), the caller relays with Asio then
+    bool init() {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd_ = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        if (ringFd_ < 0) {
+            return false;
+        }
+        sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMmap) {
+            sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+        }
+        sqRing_ = mmap(NULL, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+        if (sqRing_ == MAP_FAILED) {
+            return false;
+        }
+        cqRing_ = singleMmap ? sqRing_ : mmap(NULL, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            return false;
+        }
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) {
+            return false;
+        }
+        char *sq = static_cast<char *>(sqRing_);
+        char *cq = static_cast<char *>(cqRing_);
+        sqTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Relays until both directions have ended, an EOF is passed on as a half-close
+    void run(int clientFd, int serverFd, unsigned char *clientData, unsigned char *serverData, std::size_t length) {
+        // The sockets come from Asio in non-blocking mode; io_uring waits for them itself
+        for (int fd : {clientFd, serverFd}) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        }
+        directions_[0] = Direction{clientFd, serverFd, clientData, length};
+        directions_[1] = Direction{serverFd, clientFd, serverData, length};
+        if (provideBuffers()) {
+            directions_[0].multishot = directions_[1].multishot = true;
+        }
+        else {
+            iovec buffers[2] = {{clientData, length}, {serverData, length}};
+            fixedBuffers_ = syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_BUFFERS, buffers, 2) == 0;
+        }
+        prepRecv(0);
+        prepRecv(1);
+        while (inFlight_ > 0) {
+            SYSCALL_COUNT();
+            if (syscall(__NR_io_uring_enter, ringFd_, toSubmit_, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return; // Only on a broken ring, the caller closes the sockets
+            }
+            toSubmit_ = 0;
+            reapCompletions();
+        }
+    }
+
+  private:
+    enum {
+        URING_ENTRIES = 8,             // At most one RECV and one SEND per direction are in flight
+        URING_BUFFERS = 2,             // Provided buffers per direction, a power of two
+        URING_PAGE_SIZE = 4096,        // Each buffer ring starts on its own page
+        URING_RECV_MULTISHOT = 1 << 1, // IORING_RECV_MULTISHOT, for headers from before 6.0
+        URING_REGISTER_PBUF_RING = 22  // IORING_REGISTER_PBUF_RING, for headers from before 5.19
+    };
+
+    struct Direction {
+        int from;
+        int to;
+        unsigned char *buffer;
+        std::size_t capacity;
+        std::size_t length;
+        std::size_t sent;
+        bool done;
+        bool multishot;              // Receives with a multishot RECV into provided buffers
+        bool armed;                  // A multishot RECV is in flight
+        bool sending;                // A SEND is in flight
+        bool eof;                    // Received, still to be passed on once the chunks are sent
+        int readyBid[URING_BUFFERS]; // Received chunks not yet sent, oldest at readyFirst
+        int readyLength[URING_BUFFERS];
+        int readyFirst;
+        int readyCount;
+
+        Direction() = default;
+        Direction(int from, int to, unsigned char *buffer, std::size_t capacity)
+            : from(from), to(to), buffer(buffer), capacity(capacity), length(0), sent(0), done(false),
+              multishot(false), armed(false), sending(false), eof(false), readyFirst(0), readyCount(0) {}
+    };
+
+    // Layout of io_uring_buf and io_uring_buf_ring, for headers from before 5.19
+    struct ProvidedBuffer {
+        unsigned long long addr;
+        unsigned int len;
+        unsigned short bid;
+        unsigned short tail; // Ring tail in the first entry
+    };
+
+    struct BufferRingRegistration {
+        unsigned long long ringAddr;
+        unsigned int ringEntries;
+        unsigned short bgid;
+        unsigned short pad;
+        unsigned long long resv[3];
+    };
+
+    // Gives each direction URING_BUFFERS chunk sized buffers the kernel picks from, false
+    // if the kernel cannot do that. Their pages are only backed once data lands in them.
+    bool provideBuffers() {
+        bufferRings_ = mmap(NULL, 2 * URING_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        providedBuffers_ = mmap(NULL, 2 * URING_BUFFERS * directions_[0].capacity, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (bufferRings_ == MAP_FAILED || providedBuffers_ == MAP_FAILED) {
+            return false;
+        }
+        for (int index = 0; index < 2; index++) {
+            BufferRingRegistration registration;
+            memset(&registration, 0, sizeof(registration));
+            registration.ringAddr = reinterpret_cast<unsigned long long>(bufferRing(index));
+            registration.ringEntries = URING_BUFFERS;
+            registration.bgid = index;
+            if (syscall(__NR_io_uring_register, ringFd_, URING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+                return false;
+            }
+            for (int bid = 0; bid < URING_BUFFERS; bid++) {
+                recycleBuffer(index, bid);
+            }
+        }
+        return true;
+    }
+
+    ProvidedBuffer *bufferRing(int index) {
+        return reinterpret_cast<ProvidedBuffer *>(static_cast<char *>(bufferRings_) + index * URING_PAGE_SIZE);
+    }
+
+    unsigned char *providedBuffer(int index, int bid) {
+        return static_cast<unsigned char *>(providedBuffers_) + (index * URING_BUFFERS + bid) * directions_[index].capacity;
+    }
+
+    // Hands a buffer (back) to the kernel
+    void recycleBuffer(int index, int bid) {
+        ProvidedBuffer *ring = bufferRing(index);
+        unsigned short tail = ring[0].tail;
+        ProvidedBuffer &entry = ring[tail & (URING_BUFFERS - 1)];
+        entry.addr = reinterpret_cast<unsigned long long>(providedBuffer(index, bid));
+        entry.len = directions_[index].capacity;
+        entry.bid = bid;
+        __atomic_store_n(&ring[0].tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+    }
+
+    void reapCompletions() {
+        unsigned head = *cqHead_;
+        unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe &cqe = cqes_[head & cqMask_];
+            int index = cqe.user_data >> 1;
+            bool more = cqe.flags & IORING_CQE_F_MORE; // Only ever set for a multishot RECV
+            if (!more) {
+                inFlight_--;
+            }
+            if (cqe.user_data & 1) {
+                sendDone(index, cqe.res);
+            }
+            else if (directions_[index].multishot) {
+                multishotRecvDone(index, cqe.res, cqe.flags, more);
+            }
+            else {
+                recvDone(index, cqe.res);
+            }
+        }
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+    }
+
+    void recvDone(int index, int result) {
+        Direction &direction = directions_[index];
+        if (result == -EINTR || result == -EAGAIN) {
+            prepRecv(index);
+        }
+        else if (result == 0) {
+            shutdown(direction.to, SHUT_WR);
+            direction.done = true;
+        }
+        else if (result < 0) {
+            fail();
+        }
+        else {
+            direction.length = result;
+            direction.sent = 0;
+            prepSend(index);
+        }
+    }
+
+    void multishotRecvDone(int index, int result, unsigned int flags, bool more) {
+        Direction &direction = directions_[index];
+        direction.armed = more;
+        if (result > 0) {
+            int last = (direction.readyFirst + direction.readyCount++) % URING_BUFFERS;
+            direction.readyBid[last] = flags >> IORING_CQE_BUFFER_SHIFT;
+            direction.readyLength[last] = result;
+        }
+        else if (result == 0) {
+            direction.eof = true;
+        }
+        else if (result == -EINVAL && direction.readyCount == 0 && !direction.sending) {
+            direction.multishot = false; // Buffer rings (5.19) without multishot RECV (6.0)
+            prepRecv(index);
+            return;
+        }
+        else if (result != -ENOBUFS && result != -EINTR && result != -EAGAIN) {
+            fail();
+            return;
+        }
+        if (!direction.sending) {
+            sendNext(index);
+        }
+        // Out of buffers (ENOBUFS) it is armed again once a send returns one
+        if (!direction.armed && !direction.eof && result != -ENOBUFS) {
+            prepRecv(index);
+        }
+    }
+
+    // Sends the oldest received chunk, or passes an EOF on once they are all sent
+    void sendNext(int index) {
+        Direction &direction = directions_[index];
+        if (direction.readyCount > 0) {
+            direction.length = direction.readyLength[direction.readyFirst];
+            direction.sent = 0;
+            prepSend(index);
+        }
+        else if (direction.eof && !direction.done) {
+            shutdown(direction.to, SHUT_WR);
+            direction.done = true;
+        }
+    }
+
+    void sendDone(int index, int result) {
+        Direction &direction = directions_[index];
+        direction.sending = false;
+        if (result == -EINTR || result == -EAGAIN) {
+            prepSend(index);
+        }
+        else if (result < 0) {
+            fail();
+        }
+        else if ((direction.sent += result) < direction.length) {
+            prepSend(index); // Partial send
+        }
+        else if (direction.multishot) {
+            recycleBuffer(index, direction.readyBid[direction.readyFirst]);
+            direction.readyFirst = (direction.readyFirst + 1) % URING_BUFFERS;
+            direction.readyCount--;
+            sendNext(index);
+            if (!direction.armed && !direction.eof) {
+                prepRecv(index);
+            }
+        }
+        else {
+            prepRecv(index);
+        }
+    }
+
+    // Wakes up the other direction's pending operation, no new ones are queued after this
+    void fail() {
+        failed_ = true;
+        shutdown(directions_[0].from, SHUT_RDWR);
+        shutdown(directions_[1].from, SHUT_RDWR);
+    }
+
+    void prepRecv(int index) {
+        Direction &direction = directions_[index];
+        io_uring_sqe *sqe;
+        if (direction.multishot) {
+            sqe = prep(IORING_OP_RECV, direction.from, nullptr, 0, index << 1);
+            if (sqe != nullptr) {
+                sqe->ioprio = URING_RECV_MULTISHOT;
+                sqe->flags = IOSQE_BUFFER_SELECT;
+                sqe->buf_group = index;
+                direction.armed = true;
+            }
+        }
+        else if (fixedBuffers_) {
+            sqe = prep(IORING_OP_READ_FIXED, direction.from, direction.buffer, direction.capacity, index << 1);
+            if (sqe != nullptr) {
+                sqe->buf_index = index;
+            }
+        }
+        else {
+            prep(IORING_OP_RECV, direction.from, direction.buffer, direction.capacity, index << 1);
+        }
+    }
+
+    void prepSend(int index) {
+        Direction &direction = directions_[index];
+        unsigned char *chunk = direction.multishot ? providedBuffer(index, direction.readyBid[direction.readyFirst]) : direction.buffer;
+        if (prep(IORING_OP_SEND, direction.to, chunk + direction.sent, direction.length - direction.sent, (index << 1) | 1) != nullptr) {
+            direction.sending = true;
+        }
+    }
+
+    io_uring_sqe *prep(int opcode, int fd, unsigned char *buffer, std::size_t length, unsigned long long userData) {
+        if (failed_) {
+            return nullptr;
+        }
+        unsigned tail = *sqTail_;
+        unsigned index = tail & sqMask_;
+        io_uring_sqe &sqe = static_cast<io_uring_sqe *>(sqes_)[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<unsigned long long>(buffer);
+        sqe.len = length;
+        if (opcode != IORING_OP_READ_FIXED) {
+            sqe.msg_flags = MSG_NOSIGNAL; // Shares its field with the flags of READ_FIXED
+        }
+        sqe.user_data = userData;
+        sqArray_[index] = index;
+        __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+        toSubmit_++;
+        inFlight_++;
+        return &sqe;
+    }
+
+    int ringFd_ = -1;
+    void *sqRing_ = MAP_FAILED;
+    void *cqRing_ = MAP_FAILED;
+    void *sqes_ = MAP_FAILED;
+    void *bufferRings_ = MAP_FAILED;
+    void *providedBuffers_ = MAP_FAILED;
+    std::size_t sqRingSize_ = 0;
+    std::size_t cqRingSize_ = 0;
+    std::size_t sqesSize_ = 0;
+    unsigned *sqTail_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned *sqArray_ = nullptr;
+    unsigned *cqHead_ = nullptr;
+    unsigned *cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+    Direction directions_[2];
+    unsigned toSubmit_ = 0;
+    int inFlight_ = 0;
+    bool fixedBuffers_ = false; // Without provided buffers, RECV as READ_FIXED into registered buffers
+    bool failed_ = false;
+};
+
+class MuxStream;
+
+// SOCKS_MUX extension: one client connection carries many CONNECT streams as frames of
+//   TYPE(1) STREAM(1) LENGTH(2) PAYLOAD
+// MUX_OPEN (DSTPORT(2) DSTIP(4) DOMAIN_NAME) is answered by a one byte MUX_REPLY, then
+// MUX_DATA frames flow both ways until either side sends MUX_CLOSE. The console sends
+// the commands of all its sessions this way through a single connection and handshake.
+// Client data is queued per stream, so a server that stops reading stalls only its own
+// stream, which is closed once more than MUX_STREAM_WINDOW bytes wait for it.
+class MuxSession : public std::enable_shared_from_this<MuxSession> {
+  public:
+    MuxSession(tcp::socket socket) : socket_(std::move(socket)) {}
+
+    void start() {
+        doReadHeader();
+    }
+
+    // Queues a frame to the client, done is called once it has been written
+    void sendFrame(int type, int id, const unsigned char *data, std::size_t length, std::function<void()> done = nullptr) {
+        if (closed_) {
+            return;
+        }
+        Frame frame;
+        frame.bytes = {(unsigned char)type, (unsigned char)id, (unsigned char)(length / 256), (unsigned char)(length % 256)};
+        frame.bytes.insert(frame.bytes.end(), data, data + length);
+        frame.done = std::move(done);
+        writeQueue_.push_back(std::move(frame));
+        if (writeQueue_.size() == 1) {
+            doWrite();
+        }
+    }
+
+    // stream: only forget the id while it still belongs to this stream, the client may reuse it
+    void streamClosed(int id, const MuxStream *stream) {
+        auto it = streams_.find(id);
+        if (it != streams_.end() && it->second.get() == stream) {
+            streams_.erase(it);
+        }
+    }
+
+    tcp::socket &socket() {
+        return socket_;
+    }
+
+  private:
+    struct Frame {
+        vector<unsigned char> bytes;
+        std::function<void()> done;
+    };
+
+    void doReadHeader() {
+        auto self(shared_from_this());
+        boost::asio::async_read(
+            socket_,
+            boost::asio::buffer(header_, MUX_HEADER_SIZE),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    closeAll();
+                    return;
+                }
+                payload_.resize(header_[2] * 256 + header_[3]);
+                boost::asio::async_read(
+                    socket_,
+                    boost::asio::buffer(payload_),
+                    [this, self](boost::system::error_code ec, std::size_t) {
+                        if (ec) {
+                            closeAll();
+                            return;
+                        }
+                        handleFrame();
+                    });
+            });
+    }
+
+    void handleFrame();
+
+    void doWrite() {
+        auto self(shared_from_this());
+        boost::asio::async_write(
+            socket_,
+            boost::asio::buffer(writeQueue_.front().bytes),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    closeAll();
+                    return;
+                }
+                std::function<void()> done = std::move(writeQueue_.front().done);
+                writeQueue_.pop_front();
+                if (!writeQueue_.empty()) {
+                    doWrite();
+                }
+                if (done) {
+                    done();
+                }
+            });
+    }
+
+    void closeAll();
+
+    tcp::socket socket_;
+    map<int, std::shared_ptr<MuxStream>> streams_;
+    deque<Frame> writeQueue_;
+    unsigned char header_[MUX_HEADER_SIZE];
+    vector<unsigned char> payload_;
+    bool closed_ = false;
+};
+
+// One CONNECT stream of a MuxSession
+class MuxStream : public std::enable_shared_from_this<MuxStream> {
+  public:
+    MuxStream(int id, std::shared_ptr<MuxSession> session)
+        : id_(id), session_(std::move(session)), serverSocket_(session_->socket().get_executor()),
+          resolver_(session_->socket().get_executor()) {}
+
+    // payload: DSTPORT(2) DSTIP(4) DOMAIN_NAME, as in a SOCKS4A request
+    void open(const vector<unsigned char> &payload) {
+        if (payload.size() < 6) {
+            sendReply(SOCKS_REJECTED);
+            return;
+        }
+        auto self(shared_from_this());
+        dstPort_ = to_string((payload[0] << 8) + payload[1]);
+        dstIp_ = to_string(payload[2]) + "." + to_string(payload[3]) + "." + to_string(payload[4]) + "." + to_string(payload[5]);
+        bool hasDomain = payload[2] == 0 && payload[3] == 0 && payload[4] == 0 && payload[5] != 0;
+        string host = hasDomain ? string(payload.begin() + 6, payload.end()) : dstIp_;
+        resolver_.async_resolve(
+            host,
+            dstPort_,
+            [this, self](boost::system::error_code ec, tcp::resolver::results_type endpoints) {
+                if (closed_) {
+                    return;
+                }
+                if (ec) {
+                    sendReply(SOCKS_REJECTED);
+                    return;
+                }
+                dstIp_ = endpoints->endpoint().address().to_string();
+                vector<string> rule;
+                if (!matchFirewallRule(SOCKS_CONNECT, dstIp_, rule)) {
+                    sendReply(SOCKS_REJECTED);
+                    return;
+                }
+                string upstreamGroup;
+                parseRuleOptions(rule, profile_, upstreamGroup);
+                if (!upstreamGroup.empty()) {
+                    sendReply(MUX_USE_SOCKS4); // Parent proxies are only used by plain SOCKS4 sessions
+                    return;
+                }
+                serverSocket_.open(endpoints->endpoint().protocol(), ec);
+                applyConnectOptions(serverSocket_, profile_);
+                serverSocket_.async_connect(
+                    *endpoints,
+                    [this, self](boost::system::error_code ec) {
+                        if (closed_) {
+                            return;
+                        }
+                        if (ec) {
+                            sendReply(SOCKS_REJECTED);
+                            return;
+                        }
+                        applySocketProfile(serverSocket_, profile_);
+                        connected_ = true;
+                        sendReply(SOCKS_GRANTED);
+                        if (!writeQueue_.empty()) {
+                            doWrite();
+                        }
+                        doReadServer();
+                    });
+            });
+    }
+
+    // Client data for the server. Every stream queues its own, so a server that stops
+    // reading holds back only its stream, which is closed once MUX_STREAM_WINDOW is exceeded.
+    void write(const vector<unsigned char> &data) {
+        if (closed_) {
+            return;
+        }
+        if (queuedBytes_ + data.size() > MUX_STREAM_WINDOW) {
+            fail();
+            return;
+        }
+        queuedBytes_ += data.size();
+        writeQueue_.push_back(data);
+        if (connected_ && writeQueue_.size() == 1) {
+            doWrite();
+        }
+    }
+
+    // The client closed the stream: the data it sent before still goes to the server
+    void finish() {
+        closing_ = true;
+        if (writeQueue_.empty()) {
+            close();
+        }
+    }
+
+    void close() {
+        boost::system::error_code ec;
+        closed_ = true;
+        serverSocket_.close(ec);
+        resolver_.cancel();
+    }
+
+  private:
+    void sendReply(unsigned char reply) {
+        session_->sendFrame(MUX_REPLY, id_, &reply, 1);
+        if (reply != MUX_USE_SOCKS4) { // The client retries it as a SOCKS4 session, which reports it
+            printMessages(reply);
+        }
+        if (reply != SOCKS_GRANTED) {
+            closed_ = true;
+            session_->streamClosed(id_, this);
+        }
+    }
+
+    // The server side ended or failed: close the stream, and tell the client unless it closed it first
+    void fail() {
+        if (closed_) {
+            return;
+        }
+        close();
+        if (!closing_) {
+            session_->sendFrame(MUX_CLOSE, id_, nullptr, 0);
+            session_->streamClosed(id_, this);
+        }
+    }
+
+    void doWrite() {
+        auto self(shared_from_this());
+        boost::asio::async_write(
+            serverSocket_,
+            boost::asio::buffer(writeQueue_.front()),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (ec) {
+                    fail();
+                    return;
+                }
+                queuedBytes_ -= writeQueue_.front().size();
+                writeQueue_.pop_front();
+                if (!writeQueue_.empty()) {
+                    doWrite();
+                }
+                else if (closing_) {
+                    close();
+                }
+            });
+    }
+
+    void doReadServer() {
+        auto self(shared_from_this());
+        serverSocket_.async_read_some(
+            boost::asio::buffer(data_, mux_chunk_length),
+            [this, self](boost::system::error_code ec, std::size_t length) {
+                if (ec) {
+                    fail();
+                    return;
+                }
+                // The next read waits for this frame, so a slow client holds only one chunk per stream
+                session_->sendFrame(MUX_DATA, id_, data_, length, [this, self]() { doReadServer(); });
+            });
+    }
+
+    void printMessages(unsigned char reply) {
+        boost::system::error_code ec;
+        tcp::endpoint source = session_->socket().remote_endpoint(ec);
+        cout << "<S_IP>: " << source.address() << endl;
+        cout << "<S_PORT>: " << source.port() << endl;
+        cout << "<D_IP>: " << dstIp_ << endl;
+        cout << "<D_PORT>: " << dstPort_ << endl;
+        cout << "<Command>: CONNECT" << endl;
+        cout << "<Reply>: " << (reply == SOCKS_GRANTED ? "Accept" : "Reject") << endl;
+    }
+
+    enum { mux_chunk_length = 16384 };
+    int id_;
+    std::shared_ptr<MuxSession> session_;
+    tcp::socket serverSocket_;
+    tcp::resolver resolver_;
+    SocketProfile profile_;
+    string dstIp_;
+    string dstPort_;
+    unsigned char data_[mux_chunk_length];
+    deque<vector<unsigned char>> writeQueue_; // Client data not yet written to the server
+    std::size_t queuedBytes_ = 0;
+    bool connected_ = false;
+    bool closing_ = false; // Closed by the client, once the queue is written
+    bool closed_ = false;
+};
+
+void MuxSession::handleFrame() {
+    int type = header_[0];
+    int id = header_[1];
+    auto it = streams_.find(id);
+    if (type == MUX_OPEN && it == streams_.end()) {
+        auto stream = std::make_shared<MuxStream>(id, shared_from_this());
+        streams_[id] = stream;
+        stream->open(payload_);
+    }
+    else if (type == MUX_DATA && it != streams_.end()) {
+        it->second->write(payload_);
+    }
+    else if (type == MUX_CLOSE && it != streams_.end()) {
+        it->second->finish();
+        streams_.erase(it);
+    }
+    doReadHeader();
+}
+
+// The client is gone: close every stream, which ends the session process
+void MuxSession::closeAll() {
+    boost::system::error_code ec;
+    closed_ = true;
+    writeQueue_.clear();
+    socket_.close(ec);
+    for (auto &stream : streams_) {
+        stream.second->close();
+    }
+    streams_.clear();
+}
+
 class Session : public std::enable_shared_from_this<Session> {
   public:
     Session(tcp::socket socket, boost::asio::io_context &io_context)
         : clientSocket_(std::move(socket)), serverSocket_(io_context),
-          resolver_(io_context), acceptor_(io_context, tcp::endpoint(tcp::v4(), 0)) {}
+          resolver_(io_context), acceptor_(io_context), bindTimer_(io_context) {}
 
     void start() {
         doRead();
@@ -41,18 +1324,39 @@ class Session : public std::enable_shared_from_this<Session> {
     // First time read (SOCKS request)
     // Client (cgi) --> SOCKS Server
     void doRead() {
+        TRACE_STAGE("doRead");
         auto self(shared_from_this());
         clientSocket_.async_read_some(
             boost::asio::buffer(data_, max_length),
             [this, self](boost::system::error_code ec, std::size_t length) {
-                if (!ec) {
+                if (!ec && length >= REQUEST_HEADER_SIZE) {
+                    if (data_[1] == SOCKS_MUX) {
+                        acceptMux();
+                        return;
+                    }
                     parseSocksRequest();
                     doResolve();
                 }
             });
     }
 
+    // The streams of a SOCKS_MUX connection are checked by the firewall one by one in MuxStream
+    void acceptMux() {
+        auto self(shared_from_this());
+        memset(reply_, 0, REPLY_PACKET_SIZE);
+        reply_[1] = SOCKS_GRANTED;
+        boost::asio::async_write(
+            clientSocket_,
+            boost::asio::buffer(reply_, REPLY_PACKET_SIZE),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (!ec) {
+                    std::make_shared<MuxSession>(std::move(clientSocket_))->start();
+                }
+            });
+    }
+
     void doResolve() {
+        TRACE_STAGE("doResolve");
         auto self(shared_from_this());
         string host = getHost();
         resolver_.async_resolve(
@@ -61,6 +1365,7 @@ class Session : public std::enable_shared_from_this<Session> {
             [this, self](boost::system::error_code ec, tcp::resolver::results_type endpoints) {
                 if (!ec) {
                     setDestinationIp(endpoints);
+                    TRACE_STAGE("firewall");
                     bool status = firewall();
                     if (status) {
                         if (socksPacket.CD == SOCKS_CONNECT) {
@@ -81,44 +1386,176 @@ class Session : public std::enable_shared_from_this<Session> {
     }
 
     bool firewall() {
-        string line;
-        ifstream file("./socks.conf");
-        bool isPermit = false;
-        while (getline(file, line)) {
-            vector<string> tokens;
-            boost::split(tokens, line, boost::is_any_of(" "));
-            if (tokens.size() == 3) {
-                if (tokens[0] == "permit") {
-                    tokens[2] = regex_replace(tokens[2], regex("\\."), "\\.");  // Replace . with \.
-                    tokens[2] = regex_replace(tokens[2], regex("\\*"), "\\d+"); // Replace * with \d+
-                    regex ip(tokens[2]);
-                    if (socksPacket.CD == SOCKS_CONNECT && tokens[1] == "c") {
-                        if (regex_match(socksPacket.DSTIP, ip)) {
-                            isPermit = true;
-                            break;
-                        }
-                    }
-                    else if (socksPacket.CD == SOCKS_BIND && tokens[1] == "b") {
-                        if (regex_match(socksPacket.DSTIP, ip)) {
-                            isPermit = true;
-                            break;
-                        }
-                    }
-                }
-            }
+        vector<string> rule;
+        if (!matchFirewallRule(socksPacket.CD, socksPacket.DSTIP, rule)) {
+            return false;
         }
-        file.close();
-        return isPermit;
+        parseRuleOptions(rule, profile_, upstreamGroup_);
+        return true;
     }
 
     // Client (cgi) --- SOCKS Server <===> Server (RAS/RWG)
     void socksConnect(tcp::resolver::results_type endpoints) {
+        TRACE_STAGE("socksConnect");
+        if (!upstreamGroup_.empty()) {
+            connectParent();
+            return;
+        }
         auto self(shared_from_this());
+        boost::system::error_code ec;
+        serverSocket_.open(endpoints->endpoint().protocol(), ec);
+        applyConnectOptions(serverSocket_, profile_);
         serverSocket_.async_connect(
             *endpoints,
             [this, self](boost::system::error_code ec) {
                 if (!ec) {
-                    sendSocksReply(SOCKS_GRANTED);
+                    tunnelEstablished();
+                }
+                else {
+                    doReject();
+                }
+            });
+    }
+
+    void tunnelEstablished() {
+        applySocketProfile(clientSocket_, profile_);
+        applySocketProfile(serverSocket_, profile_);
+        sendSocksReply(SOCKS_GRANTED);
+    }
+
+    // Client (cgi) --- SOCKS Server <===> Parent SOCKS Server <===> Server (RAS/RWG)
+    void connectParent() {
+        TRACE_STAGE("connectParent");
+        auto self(shared_from_this());
+        parentIndex_ = upstreamPool.select(upstreamGroup_);
+        if (parentIndex_ < 0) {
+            doReject();
+            return;
+        }
+        const ParentProxy &parent = upstreamPool.parent(parentIndex_);
+        resolver_.async_resolve(
+            parent.host,
+            parent.port,
+            [this, self](boost::system::error_code ec, tcp::resolver::results_type endpoints) {
+                if (ec) {
+                    doReject();
+                    return;
+                }
+                serverSocket_.open(endpoints->endpoint().protocol(), ec);
+                applyConnectOptions(serverSocket_, profile_);
+                serverSocket_.async_connect(
+                    *endpoints,
+                    [this, self](boost::system::error_code ec) {
+                        if (ec) {
+                            doReject();
+                        }
+                        else if (upstreamPool.parent(parentIndex_).version == SOCKS5_VERSION) {
+                            sendParentSocks5Greeting();
+                        }
+                        else {
+                            sendParentSocks4Request();
+                        }
+                    });
+            });
+    }
+
+    void sendParentSocks4Request() {
+        boost::system::error_code ec;
+        boost::asio::ip::address_v4 ip = boost::asio::ip::make_address_v4(socksPacket.DSTIP, ec);
+        if (ec) {
+            doReject();
+            return;
+        }
+        int port = stoi(socksPacket.DSTPORT);
+        auto bytes = ip.to_bytes();
+        parentRequest_ = {SOCKS_VERSION, SOCKS_CONNECT, (unsigned char)(port / 256), (unsigned char)(port % 256)};
+        parentRequest_.insert(parentRequest_.end(), bytes.begin(), bytes.end()); // DSTIP
+        parentRequest_.push_back(0);                                              // NULL
+        writeParent(REPLY_PACKET_SIZE, [this]() {
+            if (data_[1] == SOCKS_GRANTED) {
+                tunnelEstablished();
+            }
+            else {
+                doReject();
+            }
+        });
+    }
+
+    // Greeting offering only "no authentication"
+    void sendParentSocks5Greeting() {
+        parentRequest_ = {SOCKS5_VERSION, 1, 0};
+        writeParent(2, [this]() {
+            if (data_[0] == SOCKS5_VERSION && data_[1] == 0) {
+                sendParentSocks5Request();
+            }
+            else {
+                doReject();
+            }
+        });
+    }
+
+    void sendParentSocks5Request() {
+        boost::system::error_code ec;
+        boost::asio::ip::address ip = boost::asio::ip::make_address(socksPacket.DSTIP, ec);
+        if (ec) {
+            doReject();
+            return;
+        }
+        int port = stoi(socksPacket.DSTPORT);
+        parentRequest_ = {SOCKS5_VERSION, SOCKS_CONNECT, 0};
+        if (ip.is_v4()) {
+            auto bytes = ip.to_v4().to_bytes();
+            parentRequest_.push_back(1); // ATYP IPv4
+            parentRequest_.insert(parentRequest_.end(), bytes.begin(), bytes.end());
+        }
+        else {
+            auto bytes = ip.to_v6().to_bytes();
+            parentRequest_.push_back(4); // ATYP IPv6
+            parentRequest_.insert(parentRequest_.end(), bytes.begin(), bytes.end());
+        }
+        parentRequest_.push_back(port / 256);
+        parentRequest_.push_back(port % 256);
+        // VER REP RSV ATYP, then the bound address
+        writeParent(4, [this]() {
+            if (data_[0] != SOCKS5_VERSION || data_[1] != 0) {
+                doReject();
+                return;
+            }
+            size_t addressLength = data_[3] == 1 ? 4 : data_[3] == 4 ? 16 : 0;
+            if (addressLength == 0) {
+                doReject(); // A domain name would need another read, parents reply with IPs
+                return;
+            }
+            readParent(addressLength + 2, [this]() { tunnelEstablished(); });
+        });
+    }
+
+    // Sends parentRequest_ and reads a reply of exactly replyLength bytes into data_
+    template <typename Handler>
+    void writeParent(std::size_t replyLength, Handler handler) {
+        auto self(shared_from_this());
+        boost::asio::async_write(
+            serverSocket_,
+            boost::asio::buffer(parentRequest_),
+            [this, self, replyLength, handler](boost::system::error_code ec, std::size_t) {
+                if (!ec) {
+                    readParent(replyLength, handler);
+                }
+                else {
+                    doReject();
+                }
+            });
+    }
+
+    template <typename Handler>
+    void readParent(std::size_t length, Handler handler) {
+        auto self(shared_from_this());
+        boost::asio::async_read(
+            serverSocket_,
+            boost::asio::buffer(data_, length),
+            [this, self, handler](boost::system::error_code ec, std::size_t) {
+                if (!ec) {
+                    handler();
                 }
                 else {
                     doReject();
@@ -126,30 +1563,101 @@ class Session : public std::enable_shared_from_this<Session> {
             });
     }
 
+    // The listening socket is only opened here, CONNECT sessions never create one
     void socksBind() {
-        acceptor_.listen();
+        TRACE_STAGE("socksBind");
+        if (!openBindAcceptor()) {
+            doReject();
+            return;
+        }
         unsigned short port = acceptor_.local_endpoint().port();
         socksPacket.DSTPORT = to_string(port);
         sendSocksReply(SOCKS_GRANTED, true); // first time reply (bind)
     }
 
+    // Listen on a port from "bindport <first> <last>" in socks.conf, or on any free port
+    bool openBindAcceptor() {
+        unsigned short first = 0, last = 0;
+        getBindPortRange(first, last);
+        unsigned int count = last - first + 1;
+        // Each session is its own process, so start from a pid based offset to spread them over the range
+        unsigned int offset = getpid() % count;
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned short port = first == 0 ? 0 : first + (offset + i) % count;
+            boost::system::error_code ec;
+            acceptor_.open(tcp::v4(), ec);
+            acceptor_.set_option(tcp::acceptor::reuse_address(true), ec);
+            acceptor_.bind(tcp::endpoint(tcp::v4(), port), ec);
+            if (!ec) {
+                acceptor_.listen(boost::asio::socket_base::max_listen_connections, ec);
+            }
+            if (!ec) {
+                return true;
+            }
+            acceptor_.close(ec);
+        }
+        return false;
+    }
+
+    void getBindPortRange(unsigned short &first, unsigned short &last) {
+        string line;
+        ifstream file("./socks.conf");
+        while (getline(file, line)) {
+            vector<string> tokens;
+            boost::split(tokens, line, boost::is_any_of(" "), boost::token_compress_on);
+            if (tokens.size() >= 3 && tokens[0] == "bindport") {
+                int lo = atoi(tokens[1].c_str());
+                int hi = atoi(tokens[2].c_str());
+                if (0 < lo && lo <= hi && hi <= 65535) {
+                    first = lo;
+                    last = hi;
+                }
+            }
+        }
+        file.close();
+    }
+
     void doAccept() {
         auto self(shared_from_this());
+        TRACE_STAGE("bindAccept");
+        bindTimer_.expires_after(std::chrono::seconds(BIND_ACCEPT_TIMEOUT));
+        bindTimer_.async_wait(
+            [this, self](boost::system::error_code ec) {
+                if (!ec) {
+                    acceptor_.close(ec); // aborts the pending accept
+                }
+            });
         acceptor_.async_accept(
             [this, self](boost::system::error_code ec, tcp::socket socket) {
-                if (!ec) {
+                bindTimer_.cancel();
+                boost::system::error_code ignored;
+                acceptor_.close(ignored);
+                if (!ec && isExpectedPeer(socket)) {
                     serverSocket_ = std::move(socket);
+                    applySocketProfile(clientSocket_, profile_);
+                    applySocketProfile(serverSocket_, profile_);
                     sendSocksReply(SOCKS_GRANTED); // second time reply (accept)
                 }
+                else {
+                    doReject();
+                }
             });
     }
 
+    // The incoming connection must come from the destination of the BIND request
+    bool isExpectedPeer(tcp::socket &socket) {
+        boost::system::error_code ec;
+        tcp::endpoint peer = socket.remote_endpoint(ec);
+        return !ec && peer.address().to_string() == socksPacket.DSTIP;
+    }
+
     void doReject() {
         sendSocksReply(SOCKS_REJECTED);
     }
 
     // Client (cgi) <-- SOCKS Server
     void sendSocksReply(int reply, bool isBind = false) {
+        TRACE_STAGE("sendSocksReply");
         auto self(shared_from_this());
         memset(reply_, 0, REPLY_PACKET_SIZE);
         reply_[0] = 0;
@@ -166,12 +1674,12 @@ class Session : public std::enable_shared_from_this<Session> {
             [this, self, isBind](boost::system::error_code ec, std::size_t) {
                 if (!ec) {
                     printSocksServerMessages();
+                    TRACE_FLUSH();
                     if (isBind) {
                         doAccept();
                     }
                     else if (reply_[1] == SOCKS_GRANTED) {
-                        doReadClient();
-                        doReadServer();
+                        startRelay();
                     }
                     else {
                         clientSocket_.close();
@@ -180,62 +1688,115 @@ class Session : public std::enable_shared_from_this<Session> {
             });
     }
 
+    void startRelay() {
+        SYSCALL_COUNT_START();
+        if (relayBackend == RELAY_URING) {
+            UringRelay relay;
+            if (relay.init()) {
+                relay.run(clientSocket_.native_handle(), serverSocket_.native_handle(), clientData_, serverData_, relay_length);
+                SYSCALL_COUNT_REPORT();
+                closeTunnel();
+                return;
+            }
+        }
+        // The relay handlers only capture this: the session keeps itself alive until both
+        // directions have ended, instead of copying a shared_ptr for every chunk
+        relayOwner_ = shared_from_this();
+        ALLOC_COUNT_START();
+        doReadClient();
+        doReadServer();
+    }
+
     // Client (cgi) --> SOCKS Server --- Server (RAS/RWG)
     void doReadClient() {
-        auto self(shared_from_this());
-        memset(clientData_, '\0', max_length);
         clientSocket_.async_read_some(
-            boost::asio::buffer(clientData_, max_length),
-            [this, self](boost::system::error_code ec, std::size_t length) {
+            boost::asio::buffer(clientData_, relay_length),
+            makeCustomAllocHandler(clientToServerMemory_, [this](boost::system::error_code ec, std::size_t length) {
                 if (!ec) {
+                    ALLOC_COUNT_CHUNK();
                     doWriteServer(length);
                 }
                 else {
-                    clientSocket_.close();
+                    relayDone(ec, serverSocket_);
+                    directionEnded();
                 }
-            });
+            }));
     }
 
     // Client (cgi) --- SOCKS Server <-- Server (RAS/RWG)
     void doReadServer() {
-        auto self(shared_from_this());
-        memset(serverData_, '\0', max_length);
         serverSocket_.async_read_some(
-            boost::asio::buffer(serverData_, max_length),
-            [this, self](boost::system::error_code ec, std::size_t length) {
+            boost::asio::buffer(serverData_, relay_length),
+            makeCustomAllocHandler(serverToClientMemory_, [this](boost::system::error_code ec, std::size_t length) {
                 if (!ec) {
+                    ALLOC_COUNT_CHUNK();
                     doWriteClient(length);
                 }
                 else {
-                    serverSocket_.close();
+                    relayDone(ec, clientSocket_);
+                    directionEnded();
                 }
-            });
+            }));
     }
 
     // Client (cgi) <-- SOCKS Server --- Server (RAS/RWG)
     void doWriteClient(std::size_t length) {
-        auto self(shared_from_this());
         boost::asio::async_write(
             clientSocket_,
             boost::asio::buffer(serverData_, length),
-            [this, self](boost::system::error_code ec, std::size_t) {
+            makeCustomAllocHandler(serverToClientMemory_, [this](boost::system::error_code ec, std::size_t) {
                 if (!ec) {
                     doReadServer();
                 }
-            });
+                else {
+                    closeTunnel();
+                    directionEnded();
+                }
+            }));
     }
 
     // Client (cgi) --- SOCKS Server --> Server (RAS/RWG)
     void doWriteServer(std::size_t length) {
-        auto self(shared_from_this());
         boost::asio::async_write(
             serverSocket_,
             boost::asio::buffer(clientData_, length),
-            [this, self](boost::system::error_code ec, std::size_t) {
+            makeCustomAllocHandler(clientToServerMemory_, [this](boost::system::error_code ec, std::size_t) {
                 if (!ec) {
                     doReadClient();
                 }
-            });
+                else {
+                    closeTunnel();
+                    directionEnded();
+                }
+            }));
+    }
+
+    // One relay direction ended: pass an EOF on as a half-close, and close the tunnel
+    // once both directions are done so the session (and its process) can finish
+    void relayDone(boost::system::error_code ec, tcp::socket &to) {
+        if (ec != boost::asio::error::eof) {
+            closeTunnel();
+            return;
+        }
+        to.shutdown(tcp::socket::shutdown_send, ec);
+        if (++relaysDone_ == 2) {
+            closeTunnel();
+        }
+    }
+
+    // Each direction stops issuing operations exactly once, the last one releases the session
+    void directionEnded() {
+        if (++directionsEnded_ == 2) {
+            ALLOC_COUNT_REPORT();
+            SYSCALL_COUNT_REPORT();
+            relayOwner_.reset(); // May destroy this, so it comes last
+        }
+    }
+
+    void closeTunnel() {
+        boost::system::error_code ec;
+        clientSocket_.close(ec);
+        serverSocket_.close(ec);
     }
 
     void parseSocksRequest() {
@@ -275,19 +1836,212 @@ class Session : public std::enable_shared_from_this<Session> {
     tcp::socket clientSocket_;
     tcp::socket serverSocket_;
     tcp::resolver resolver_;
-    tcp::acceptor acceptor_; // For SOCKS BIND
+    tcp::acceptor acceptor_; // For SOCKS BIND, opened in socksBind()
+    boost::asio::steady_timer bindTimer_;
     enum { max_length = 1024 };
+    enum { relay_length = 65536 }; // Large relay chunks keep wakeups and syscalls per byte low
     unsigned char data_[max_length];
-    unsigned char clientData_[max_length];
-    unsigned char serverData_[max_length];
+    unsigned char clientData_[relay_length];
+    unsigned char serverData_[relay_length];
     unsigned char reply_[REPLY_PACKET_SIZE];
+    HandlerMemory clientToServerMemory_; // One operation in flight per relay direction
+    HandlerMemory serverToClientMemory_;
     SocketsPacket socksPacket;
+    SocketProfile profile_;
+    string upstreamGroup_;
+    int parentIndex_ = -1; // Parent proxy in use, released when the main process reaps the session
+    vector<unsigned char> parentRequest_;
+    int relaysDone_ = 0;
+    std::shared_ptr<Session> relayOwner_; // Set while the Asio relay runs
+    int directionsEnded_ = 0;
+};
+
+// Periodically connects to every parent proxy, run only in the main process
+class HealthProber {
+  public:
+    HealthProber(boost::asio::io_context &io_context)
+        : io_context_(io_context), timer_(io_context) {}
+
+    void start() {
+        if (upstreamPool.size() > 0) {
+            probeAll();
+        }
+    }
+
+    // Forked sessions must not keep probing
+    void stop() {
+        stopped_ = true;
+        timer_.cancel();
+    }
+
+  private:
+    void probeAll() {
+        for (int i = 0; i < upstreamPool.size(); i++) {
+            probe(i);
+        }
+        timer_.expires_after(std::chrono::seconds(PROBE_INTERVAL));
+        timer_.async_wait(
+            [this](boost::system::error_code ec) {
+                if (!ec && !stopped_) {
+                    probeAll();
+                }
+            });
+    }
+
+    void probe(int index) {
+        auto socket = std::make_shared<tcp::socket>(io_context_);
+        auto resolver = std::make_shared<tcp::resolver>(io_context_);
+        auto deadline = std::make_shared<boost::asio::steady_timer>(io_context_);
+        auto begin = std::chrono::steady_clock::now();
+        const ParentProxy &parent = upstreamPool.parent(index);
+        resolver->async_resolve(
+            parent.host,
+            parent.port,
+            [this, index, socket, resolver, deadline, begin](boost::system::error_code ec, tcp::resolver::results_type endpoints) {
+                if (stopped_) {
+                    return;
+                }
+                if (ec) {
+                    upstreamPool.setProbeResult(index, false, 0);
+                    return;
+                }
+                deadline->expires_after(std::chrono::seconds(PROBE_TIMEOUT));
+                deadline->async_wait(
+                    [socket](boost::system::error_code ec) {
+                        if (!ec) {
+                            socket->close(ec);
+                        }
+                    });
+                boost::asio::async_connect(
+                    *socket,
+                    endpoints,
+                    [this, index, socket, deadline, begin](boost::system::error_code ec, const tcp::endpoint &) {
+                        deadline->cancel();
+                        if (stopped_) {
+                            return;
+                        }
+                        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+                        upstreamPool.setProbeResult(index, !ec, latency.count());
+                    });
+            });
+    }
+
+    boost::asio::io_context &io_context_;
+    boost::asio::steady_timer timer_;
+    bool stopped_ = false;
 };
 
+// Asio leaves a closed socket in its epoll set, relying on close() to remove it, which
+// only happens once no other process has it open. A socket shared with a forked process
+// would keep waking this one up, so it is taken out of epoll first.
+template <typename Socket>
+void closeShared(Socket &socket) {
+    boost::system::error_code ec;
+    int fd = socket.release(ec);
+    if (!ec) {
+        close(fd);
+    }
+}
+
+// Passes a listening socket between an old and a new instance over a Unix domain socket (SCM_RIGHTS)
+bool sendListener(int unixFd, int listenFd) {
+    char byte = 0;
+    iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &listenFd, sizeof(int));
+    return sendmsg(unixFd, &message, 0) == 1;
+}
+
+int receiveListener(int unixFd) {
+    char byte;
+    iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(unixFd, &message, 0) != 1) {
+        return -1;
+    }
+    cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int listenFd;
+    memcpy(&listenFd, CMSG_DATA(header), sizeof(int));
+    return listenFd;
+}
+
+// Asks an instance already running on this port for its listening socket, -1 if there is none.
+// The running instance keeps accepting until confirmListener() is sent over the same control socket.
+int takeOverListener(boost::asio::local::stream_protocol::socket &control, const string &controlPath) {
+    boost::system::error_code ec;
+    control.connect(boost::asio::local::stream_protocol::endpoint(controlPath), ec);
+    if (ec) {
+        return -1;
+    }
+    return receiveListener(control.native_handle());
+}
+
+// Tells the previous instance that this one is accepting on the listener, so it can drain
+void confirmListener(boost::asio::local::stream_protocol::socket &control) {
+    boost::system::error_code ec;
+    char ack = HANDOVER_ACK;
+    boost::asio::write(control, boost::asio::buffer(&ack, 1), ec);
+    control.close(ec);
+}
+
 class Server {
   public:
-    Server(boost::asio::io_context &io_context, short port)
-        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), io_context_(io_context) {
+    // listenFd: listening socket taken over from the previous instance, or -1 to open a new one
+    Server(boost::asio::io_context &io_context, short port, int listenFd, const string &controlPath)
+        : acceptor_(io_context), controlAcceptor_(io_context), handover_(io_context), handoverTimer_(io_context),
+          signals_(io_context, SIGCHLD), drainTimer_(io_context), io_context_(io_context), prober_(io_context) {
+        if (listenFd >= 0) {
+            acceptor_.assign(tcp::v4(), listenFd);
+        }
+        else {
+            tcp::endpoint endpoint(tcp::v4(), port);
+            acceptor_.open(endpoint.protocol());
+            acceptor_.set_option(tcp::acceptor::reuse_address(true));
+            acceptor_.bind(endpoint);
+            acceptor_.listen();
+        }
+#ifdef TCP_FASTOPEN
+        int queueLength = LISTEN_FASTOPEN_QUEUE; // SOCKS clients speak first, so TFO is always safe here
+        setsockopt(acceptor_.native_handle(), IPPROTO_TCP, TCP_FASTOPEN, &queueLength, sizeof(queueLength));
+#endif
+        // Only this user may take the listener. Bound under a temporary name and renamed, so the
+        // previous instance stays reachable until then and the path never exists with other modes.
+        string bindPath = controlPath + "." + to_string(getpid());
+        unlink(bindPath.c_str());
+        controlAcceptor_.open();
+        mode_t mask = umask(0177);
+        boost::system::error_code ec;
+        controlAcceptor_.bind(boost::asio::local::stream_protocol::endpoint(bindPath), ec);
+        umask(mask);
+        if (!ec) {
+            controlAcceptor_.listen(boost::asio::socket_base::max_listen_connections, ec);
+        }
+        if (ec || rename(bindPath.c_str(), controlPath.c_str()) != 0) {
+            unlink(bindPath.c_str());
+            throw runtime_error("bind " + controlPath + " failed");
+        }
+
+        prober_.start();
+        doWaitChild();
+        doControlAccept();
         doAccept();
     }
 
@@ -300,19 +2054,143 @@ class Server {
                     pid_t pid = fork();
                     if (pid == 0) {
                         io_context_.notify_fork(boost::asio::io_context::fork_child);
+                        closeInChild();
                         std::make_shared<Session>(std::move(socket), io_context_)->start();
                     }
                     else {
                         io_context_.notify_fork(boost::asio::io_context::fork_parent);
-                        socket.close();
+                        if (pid > 0) {
+                            children_.insert(pid);
+                        }
+                        closeShared(socket);
                         doAccept();
                     }
                 }
             });
     }
 
+    // A session only needs its own sockets
+    void closeInChild() {
+        boost::system::error_code ec;
+        prober_.stop();
+        signals_.cancel(ec);
+        handoverTimer_.cancel(ec);
+        closeShared(handover_);
+        closeShared(controlAcceptor_);
+        closeShared(acceptor_);
+        children_.clear();
+    }
+
+    void doWaitChild() {
+        signals_.async_wait(
+            [this](boost::system::error_code ec, int /*signo*/) {
+                if (ec) {
+                    return;
+                }
+                pid_t pid;
+                while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+                    children_.erase(pid);
+                    upstreamPool.release(pid);
+                }
+                if (draining_ && children_.empty()) {
+                    finishDrain();
+                    return;
+                }
+                doWaitChild();
+            });
+    }
+
+    // A new instance connected to the control socket: hand it the listener, and drain once it
+    // confirms it is accepting. Until then this instance keeps accepting too.
+    void doControlAccept() {
+        controlAcceptor_.async_accept(
+            handover_,
+            [this](boost::system::error_code ec) {
+                if (ec) {
+                    return;
+                }
+                ucred peer;
+                socklen_t length = sizeof(peer);
+                if (getsockopt(handover_.native_handle(), SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0 ||
+                    peer.uid != getuid() || !sendListener(handover_.native_handle(), acceptor_.native_handle())) {
+                    endHandover();
+                    return;
+                }
+                doReadAck();
+            });
+    }
+
+    void doReadAck() {
+        handoverTimer_.expires_after(std::chrono::seconds(HANDOVER_TIMEOUT));
+        handoverTimer_.async_wait(
+            [this](boost::system::error_code ec) {
+                if (!ec) {
+                    handover_.cancel(ec);
+                }
+            });
+        boost::asio::async_read(
+            handover_,
+            boost::asio::buffer(&ack_, 1),
+            [this](boost::system::error_code ec, std::size_t /*length*/) {
+                if (!ec && ack_ == HANDOVER_ACK) {
+                    handoverTimer_.cancel(ec);
+                    handover_.close(ec);
+                    startDrain();
+                    return;
+                }
+                endHandover(); // The new instance went away (or never was one): keep serving
+            });
+    }
+
+    void endHandover() {
+        boost::system::error_code ec;
+        handoverTimer_.cancel(ec);
+        handover_.close(ec);
+        doControlAccept();
+    }
+
+    // Stop accepting (the new instance owns the listener now) and wait for the running tunnels
+    void startDrain() {
+        boost::system::error_code ec;
+        draining_ = true;
+        closeShared(acceptor_); // Still open in the new instance
+        controlAcceptor_.close(ec);
+        prober_.stop();
+        cerr << "Handed over listener, draining " << children_.size() << " session(s)" << endl;
+        if (children_.empty()) {
+            finishDrain();
+            return;
+        }
+        drainTimer_.expires_after(std::chrono::seconds(DRAIN_TIMEOUT));
+        drainTimer_.async_wait(
+            [this](boost::system::error_code ec) {
+                if (!ec) {
+                    for (pid_t pid : children_) {
+                        kill(pid, SIGTERM);
+                    }
+                    finishDrain();
+                }
+            });
+    }
+
+    void finishDrain() {
+        boost::system::error_code ec;
+        drainTimer_.cancel(ec);
+        signals_.cancel(ec);
+        io_context_.stop();
+    }
+
     tcp::acceptor acceptor_;
+    boost::asio::local::stream_protocol::acceptor controlAcceptor_;
+    boost::asio::local::stream_protocol::socket handover_; // Control connection of a new instance
+    boost::asio::steady_timer handoverTimer_;
+    char ack_;
+    boost::asio::signal_set signals_;
+    boost::asio::steady_timer drainTimer_;
+    set<pid_t> children_;
+    bool draining_ = false;
     boost::asio::io_context &io_context_;
+    HealthProber prober_;
 };
 
 int main(int argc, char *argv[]) {
@@ -324,7 +2202,15 @@ int main(int argc, char *argv[]) {
 
         boost::asio::io_context io_context;
 
-        Server s(io_context, std::atoi(argv[1]));
+        // A running instance on the same port hands over its listener, so restarts refuse no connections
+        string controlPath = string("./socks_server_") + argv[1] + ".sock";
+        boost::asio::local::stream_protocol::socket control(io_context);
+        int listenFd = takeOverListener(control, controlPath);
+
+        upstreamPool.load("./socks.conf");
+        loadRelayBackend("./socks.conf");
+        Server s(io_context, std::atoi(argv[1]), listenFd, controlPath);
+        confirmListener(control);
 
         io_context.run();
     } catch (std::exception &e) {
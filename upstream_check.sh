@@ -0,0 +1,57 @@
+#!/bin/sh
+# Checks that socks_server keeps the leastconn counts of its parent proxies right when
+# sessions are killed, with two local socks_server instances as parents. Run by
+# "make upstream_check". Parent B starts late, so the first tunnels all go to parent A;
+# those sessions are then killed with SIGKILL, and once B is healthy the next tunnels
+# must be split evenly between A and B.
+TUNNELS=4
+FRONT_PORT=${FRONT_PORT:-17300}
+PARENT_A_PORT=${PARENT_A_PORT:-17301}
+PARENT_B_PORT=${PARENT_B_PORT:-17302}
+ECHO_PORT=${ECHO_PORT:-17303}
+HERE=$(cd "$(dirname "$0")" && pwd)
+DIR=$(mktemp -d)
+trap 'kill $ECHO $FRONT $PARENT_A $PARENT_B $HOLD 2>/dev/null; rm -rf "$DIR"' EXIT
+
+mkdir "$DIR/front" "$DIR/a" "$DIR/b"
+printf 'upstream pool leastconn socks4://127.0.0.1:%s socks4://127.0.0.1:%s\npermit c *.*.*.* upstream=pool\n' \
+  "$PARENT_A_PORT" "$PARENT_B_PORT" >"$DIR/front/socks.conf"
+printf 'permit c *.*.*.*\n' >"$DIR/a/socks.conf"
+printf 'permit c *.*.*.*\n' >"$DIR/b/socks.conf"
+
+accepted() {
+  grep -c "Accept" "$DIR/$1/log"
+}
+
+"$HERE/relay_bench" echo "$ECHO_PORT" &
+ECHO=$!
+(cd "$DIR/a" && exec "$HERE/socks_server" "$PARENT_A_PORT" >log 2>&1) &
+PARENT_A=$!
+(cd "$DIR/front" && exec "$HERE/socks_server" "$FRONT_PORT" >log 2>&1) &
+FRONT=$!
+sleep 1 # The first probe marks B down
+
+"$HERE/relay_bench" open "$FRONT_PORT" "$ECHO_PORT" "$TUNNELS" &
+HOLD=$!
+sleep 1
+echo "parent A: $(accepted a) tunnels"
+kill -9 $(pgrep -P $FRONT) # Sessions die without running any of their code
+kill $HOLD
+wait $HOLD 2>/dev/null
+
+(cd "$DIR/b" && exec "$HERE/socks_server" "$PARENT_B_PORT" >log 2>&1) &
+PARENT_B=$!
+echo "waiting for the next probe"
+sleep 11
+
+"$HERE/relay_bench" open "$FRONT_PORT" "$ECHO_PORT" "$TUNNELS" &
+HOLD=$!
+sleep 1
+A=$(($(accepted a) - TUNNELS))
+B=$(accepted b)
+echo "parent A: $A tunnels, parent B: $B tunnels"
+if [ "$A" -ne $((TUNNELS / 2)) ] || [ "$B" -ne $((TUNNELS / 2)) ]; then
+  echo "FAIL"
+  exit 1
+fi
+echo "OK"